@@ -0,0 +1,225 @@
+/*
+	CBVH++: Loads a skeletal animation
+	Copyright(C) 2017 Vincent Petrella
+
+	This program is free software : you can redistribute it and / or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <vector>
+#include <string>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include "animation.h"
+#include "forward_Kinematics.h"
+#include "simd_Dispatch.h"
+
+/*
+	Forward kinematics benchmark:
+
+	Poses every frame of a synthetic clip (one skeleton of 106 joints, 76 of them animated, fanning out like hands; 2000 frames)
+	and reports poses/s (best of 5 runs) for each way of posing it:
+	- the recursive FK the library had before the skeleton was flattened: 4x4 matrices looked up by joint name, composed
+	  down the SkeletonJoint tree, positions pushed into a vector. It is the reference the others are measured against,
+	then on every SIMD path the CPU supports:
+	- the container query (vector of positions) and the array query,
+	- ComputeJointPoses alone, on local transforms read out of the motion beforehand,
+	- ComputeWorldPoses on one thread, every frame in one call.
+	On the scalar path, every kernel composes Transforms one at a time.
+
+	Build from the src directory:
+		g++ -O2 -std=c++17 -pthread -I. *.cpp ../bench/fk_Benchmark.cpp -o ../fk_Benchmark
+*/
+
+static const int FRAME_COUNT = 2000;
+static const int RUN_COUNT = 5;
+
+// Children of a joint at each depth: spine, then branches fanning out into fingers
+static const int JOINT_FANOUT[] = { 3, 1, 1, 2, 5, 1, 0 };
+
+void WriteJoint(string& text, int depth, string name, int& channelCount)
+{
+	string indent(depth, '\t');
+	char offset[64];
+	snprintf(offset, sizeof(offset), "OFFSET %.2f %.2f %.2f\n", 0.5f * (depth % 3), 2.0f + depth, 0.25f * depth);
+
+	text += indent + (depth ? "JOINT " : "ROOT ") + name + "\n" + indent + "{\n" + indent + "\t" + offset;
+	text += indent + (depth ? "\tCHANNELS 3 Zrotation Xrotation Yrotation\n" : "\tCHANNELS 6 Xposition Yposition Zposition Zrotation Xrotation Yrotation\n");
+	channelCount += depth ? 3 : 6;
+
+	if (JOINT_FANOUT[depth])
+	{
+		for (int child = 0; child < JOINT_FANOUT[depth]; child++)
+			WriteJoint(text, depth + 1, name + "_" + to_string(child), channelCount);
+	}
+	else
+	{
+		text += indent + "\tEnd Site\n" + indent + "\t{\n" + indent + "\t\tOFFSET 0.00 1.00 0.00\n" + indent + "\t}\n";
+	}
+	text += indent + "}\n";
+}
+
+string MakeClip()
+{
+	string text = "HIERARCHY\n";
+	int channelCount = 0;
+	WriteJoint(text, 0, "Hips", channelCount);
+
+	text += "MOTION\nFrames: " + to_string(FRAME_COUNT) + "\nFrame Time: 0.008333\n";
+	for (int frame = 0; frame < FRAME_COUNT; frame++)
+	{
+		for (int channel = 0; channel < channelCount; channel++)
+		{
+			char value[32];
+			snprintf(value, sizeof(value), "%.4f ", 45.0f * sinf(0.01f * frame + 0.7f * channel));
+			text += value;
+		}
+		text += "\n";
+	}
+	return text;
+}
+
+// Poses per second of the best of RUN_COUNT runs of run, which poses every frame once
+template <typename Run>
+double MeasurePosesPerSecond(Run run)
+{
+	double best = 1e30;
+	for (int i = 0; i < RUN_COUNT; i++)
+	{
+		auto start = chrono::steady_clock::now();
+		run();
+		best = std::min(best, chrono::duration<double>(chrono::steady_clock::now() - start).count());
+	}
+	return FRAME_COUNT / best;
+}
+
+void PrintResult(const char* path, const char* kernel, double posesPerSecond, int jointCount)
+{
+	printf("%-8s %-28s %10.0f poses/s %8.1f ns/joint\n", path, kernel, posesPerSecond, 1e9 / (posesPerSecond * jointCount));
+}
+
+void PoseRecursive(SkeletonJoint* joint, const mat4& cumulativeTransform, unordered_map<string, vector<mat4>>& jointTransforms, int frameIndex, vector<vec3>* jointPositions)
+{
+	jointPositions->push_back(vec3(cumulativeTransform * vec4(joint->GetLocalOffset(), 1)));
+
+	mat4 nextCumulativeTransform;
+	if (joint->GetDirectChildren().size())
+		nextCumulativeTransform = cumulativeTransform * jointTransforms[joint->GetName()][frameIndex];
+
+	for (SkeletonJoint* child : joint->GetDirectChildren())
+		PoseRecursive(child, nextCumulativeTransform, jointTransforms, frameIndex, jointPositions);
+}
+
+int main()
+{
+	const char* clipPath = "fk_Benchmark.bvh";
+	FILE* clipFile = fopen(clipPath, "wb");
+	string clip = MakeClip();
+	if (!clipFile || fwrite(clip.data(), 1, clip.size(), clipFile) != clip.size() || fclose(clipFile))
+		return 1;
+
+	streambuf* output = cout.rdbuf(NULL);
+	SkeletalMotion* motion = SkeletalMotion::BVHImport(clipPath);
+	cout.rdbuf(output);
+	remove(clipPath);
+	if (!motion)
+		return 1;
+
+	const FlatSkeleton& skeleton = motion->GetFlatSkeleton();
+	int jointCount = skeleton.GetJointCount();
+	int trackCount = skeleton.GetTrackCount();
+	vector<vec3> positions(jointCount);
+	vector<vec3> batchPositions((size_t)FRAME_COUNT * jointCount);
+	float checksum = 0;
+
+	// Local transforms of every frame, as the reference keeps them and as the kernels read them
+	unordered_map<string, vector<mat4>> jointTransforms;
+	vector<Transform> localTransforms((size_t)FRAME_COUNT * trackCount);
+	for (int track = 0; track < trackCount; track++)
+	{
+		JointHandle joint(skeleton.trackJoints[track]);
+		vector<mat4>& matrices = jointTransforms[skeleton.GetJointName(joint.jointIndex)];
+		for (int frame = 0; frame < FRAME_COUNT; frame++)
+		{
+			Transform transform = motion->GetLocalTransformByHandle(joint, frame);
+			localTransforms[(size_t)frame * trackCount + track] = transform;
+
+			mat4 matrix(transform.GetRotation());
+			matrix[3] = vec4(transform.GetOrigin(), 1);
+			matrices.push_back(matrix);
+		}
+	}
+
+	vector<vec3> containerPositions;
+	double posesPerSecond = MeasurePosesPerSecond([&]()
+	{
+		for (int frame = 0; frame < FRAME_COUNT; frame++)
+		{
+			containerPositions.clear();
+			PoseRecursive(motion->GetRoot(0), mat4(1), jointTransforms, frame, &containerPositions);
+			checksum += containerPositions.back().x;
+		}
+	});
+	PrintResult("", "recursive mat4 (reference)", posesPerSecond, jointCount);
+
+	for (int path = SIMD_PATH_SCALAR; path <= GetSupportedSimdPath(); path++)
+	{
+		SetSimdPath((SimdPath)path);
+		const char* pathName = GetSimdPathName((SimdPath)path);
+
+		posesPerSecond = MeasurePosesPerSecond([&]()
+		{
+			for (int frame = 0; frame < FRAME_COUNT; frame++)
+			{
+				containerPositions.clear();
+				motion->QuerySkeletalAnimation(frame, 0, false, &containerPositions);
+				checksum += containerPositions.back().x;
+			}
+		});
+		PrintResult(pathName, "container query", posesPerSecond, jointCount);
+
+		posesPerSecond = MeasurePosesPerSecond([&]()
+		{
+			for (int frame = 0; frame < FRAME_COUNT; frame++)
+			{
+				motion->QuerySkeletalAnimation(frame, 0, false, positions.data(), NULL, NULL);
+				checksum += positions.back().x;
+			}
+		});
+		PrintResult(pathName, "array query", posesPerSecond, jointCount);
+
+		posesPerSecond = MeasurePosesPerSecond([&]()
+		{
+			for (int frame = 0; frame < FRAME_COUNT; frame++)
+			{
+				ComputeJointPoses(skeleton, 0, Transform(), &localTransforms[(size_t)frame * trackCount], 1, positions.data(), NULL, NULL);
+				checksum += positions.back().x;
+			}
+		});
+		PrintResult(pathName, "ComputeJointPoses", posesPerSecond, jointCount);
+
+		posesPerSecond = MeasurePosesPerSecond([&]()
+		{
+			motion->ComputeWorldPoses(0, FRAME_COUNT, 1, batchPositions.data(), NULL, false, 1);
+			checksum += batchPositions.back().x;
+		});
+		PrintResult(pathName, "ComputeWorldPoses, 1 thread", posesPerSecond, jointCount);
+	}
+
+	// Keeps the poses from being optimized away
+	printf("checksum %g\n", checksum);
+
+	delete motion;
+	return 0;
+}
@@ -0,0 +1,127 @@
+/*
+	CBVH++: Loads a skeletal animation
+	Copyright(C) 2017 Vincent Petrella
+
+	This program is free software : you can redistribute it and / or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <vector>
+#include <string>
+#include <random>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string.h>
+#include "number_Parsing.h"
+#include "simd_Dispatch.h"
+
+/*
+	Parse throughput benchmark:
+
+	Parses a MOTION-like block of 2M values with ParseFloatRow on every SIMD path the CPU supports, with the from_chars
+	reference (ParseFloatRowScalar), and with atof on NUL terminated tokens, which is what the importer used to do.
+	Reports MB/s (best of 5 runs) and fails if any path does not match the reference bit for bit.
+
+	Build from the repository root:
+		g++ -O2 -std=c++17 -Isrc src/number_Parsing.cpp src/simd_Dispatch.cpp bench/parse_Benchmark.cpp -o parse_Benchmark
+*/
+
+using namespace std;
+
+static const int VALUE_COUNT = 2000000;
+static const int RUN_COUNT = 5;
+
+// Mostly mocap style values (%.6f), with some of everything else the parser handles
+string MakeMotionText(int valueCount)
+{
+	mt19937 random(1);
+	uniform_real_distribution<double> values(-1000, 1000);
+
+	string text;
+	for (int i = 0; i < valueCount; i++)
+	{
+		char value[64];
+		double v = values(random);
+		switch (random() % 10)
+		{
+		case 0: snprintf(value, sizeof(value), "%.*f", (int)(random() % 14), v); break;
+		case 1: snprintf(value, sizeof(value), "%g", v * 1e-9); break;
+		case 2: snprintf(value, sizeof(value), "%d", (int)v); break;
+		case 3: snprintf(value, sizeof(value), "%.12f", v / 1000); break;
+		case 4: snprintf(value, sizeof(value), "+%.3f", v); break;
+		default: snprintf(value, sizeof(value), "%.6f", v); break;
+		}
+		text += value;
+		text += random() % 7 ? " " : "\r\n";
+	}
+	return text;
+}
+
+// Best time of RUN_COUNT runs of run, in seconds
+template <typename Run>
+double TimeBest(Run run)
+{
+	double best = 1e30;
+	for (int i = 0; i < RUN_COUNT; i++)
+	{
+		auto start = chrono::steady_clock::now();
+		run();
+		best = min(best, chrono::duration<double>(chrono::steady_clock::now() - start).count());
+	}
+	return best;
+}
+
+int main()
+{
+	string text = MakeMotionText(VALUE_COUNT);
+	const char* textEnd = text.data() + text.size();
+	double megabytes = text.size() / 1e6;
+
+	vector<float> reference(VALUE_COUNT);
+	vector<float> values(VALUE_COUNT);
+	bool bMatching = true;
+
+	double seconds = TimeBest([&]() { ParseFloatRowScalar(text.data(), textEnd, reference.data(), VALUE_COUNT); });
+	printf("%-24s %8.1f MB/s\n", "from_chars (scalar)", megabytes / seconds);
+
+	for (int path = SIMD_PATH_SSE2; path <= GetSupportedSimdPath(); path++)
+	{
+		SetSimdPath((SimdPath)path);
+		seconds = TimeBest([&]() { ParseFloatRow(text.data(), textEnd, values.data(), VALUE_COUNT); });
+
+		bool bSame = !memcmp(values.data(), reference.data(), VALUE_COUNT * sizeof(float));
+		bMatching = bMatching && bSame;
+		printf("%-24s %8.1f MB/s%s\n", GetSimdPathName((SimdPath)path), megabytes / seconds, bSame ? "" : "  MISMATCH");
+	}
+
+	// The old path: a NUL terminated string per value, then atof
+	vector<string> tokens;
+	tokens.reserve(VALUE_COUNT);
+	for (const char* cursor = SkipTokenSeparators(text.data(), textEnd); cursor < textEnd; cursor = SkipTokenSeparators(cursor, textEnd))
+	{
+		const char* tokenEnd = cursor;
+		while (tokenEnd < textEnd && !IsTokenSeparator(*tokenEnd))
+			tokenEnd++;
+		tokens.push_back(string(cursor, tokenEnd));
+		cursor = tokenEnd;
+	}
+	seconds = TimeBest([&]()
+	{
+		for (int i = 0; i < VALUE_COUNT; i++)
+			values[i] = (float)atof(tokens[i].c_str());
+	});
+	printf("%-24s %8.1f MB/s\n", "atof", megabytes / seconds);
+
+	return bMatching ? 0 : 1;
+}
@@ -20,7 +20,12 @@
 #include <iostream>
 #include <string.h>
 #include <stack>
+#include <thread>
+#include <algorithm>
 #include "animation.h"
+#include "file_Mapping.h"
+#include "forward_Kinematics.h"
+#include "euler_Rotations.h"
 
 void PrintJointRecursive(SkeletonJoint* joint, int depth)
 {
@@ -38,138 +43,121 @@ void SkeletonJoint::PrintJoint()
 	PrintJointRecursive(this, 0);
 }
 
-Transform::Transform()
-{
-	m_transformMatrix = mat4(1);
-}
-
-Transform::Transform(mat3 rotation, vec3 origin)
-{
-	m_transformMatrix = mat4
-	(
-		vec4(rotation[0][0], rotation[0][1], rotation[0][2], 0),
-		vec4(rotation[1][0], rotation[1][1], rotation[1][2], 0),
-		vec4(rotation[2][0], rotation[2][1], rotation[2][2], 0),
-		vec4(origin.x, origin.y, origin.z, 1)
-	);
-}
-
-Transform::~Transform() {}
-
-vec3 Transform::GetOrigin()
-{
-	return m_transformMatrix * vec4(0, 0, 0, 1);
-}
-
 void Transform::SetOrigin(vec3 origin)
 {
-	m_transformMatrix = mat4
-	(
-		vec4(m_transformMatrix[0][0], m_transformMatrix[0][1], m_transformMatrix[0][2], 0),
-		vec4(m_transformMatrix[1][0], m_transformMatrix[1][1], m_transformMatrix[1][2], 0),
-		vec4(m_transformMatrix[2][0], m_transformMatrix[2][1], m_transformMatrix[2][2], 0),
-		vec4(origin.x, origin.y, origin.z, 1)
-	);
+	m_origin = origin;
 }
 
 void Transform::SetRotation(mat3 rotation)
 {
-	m_transformMatrix = mat4
-	(
-		vec4(rotation[0][0], rotation[0][1], rotation[0][2], 0),
-		vec4(rotation[1][0], rotation[1][1], rotation[1][2], 0),
-		vec4(rotation[2][0], rotation[2][1], rotation[2][2], 0),
-		vec4(m_transformMatrix[3][0], m_transformMatrix[3][1], m_transformMatrix[3][2], 1)
-	);
-}
-
-mat3 Transform::GetRotation()
-{
-	mat3 rotation
-	(
-		vec3(m_transformMatrix[0][0], m_transformMatrix[0][1], m_transformMatrix[0][2]),
-		vec3(m_transformMatrix[1][0], m_transformMatrix[1][1], m_transformMatrix[1][2]),
-		vec3(m_transformMatrix[2][0], m_transformMatrix[2][1], m_transformMatrix[2][2])
-	);
-
-	return rotation;
+	m_rotation = rotation;
 }
 
-Transform Transform::GetInverse()
+Transform Transform::GetInverse() const
 {
-	mat3 inverseRotation
-	(
-		vec3(m_transformMatrix[0][0], m_transformMatrix[1][0], m_transformMatrix[2][0]),
-		vec3(m_transformMatrix[0][1], m_transformMatrix[1][1], m_transformMatrix[2][1]),
-		vec3(m_transformMatrix[0][2], m_transformMatrix[1][2], m_transformMatrix[2][2])
-	);
+	// The inverse of a rotation is its transpose
+	mat3 inverseRotation = transpose(m_rotation);
 
-	vec3 origin(m_transformMatrix[3][0], m_transformMatrix[3][1], m_transformMatrix[3][2]);
-
-	return Transform(inverseRotation, -(inverseRotation*origin));
+	return Transform(inverseRotation, -(inverseRotation*m_origin));
 }
 
-void QuerySkeletalAnimationRecursive
+void SkeletalMotion::QuerySkeletalAnimation
 (
-/*Defines the recursion parameters */
-SkeletonJoint* joint,
-Transform& cumulativeTransform,
-unordered_map<string, vector<Transform>>& jointTransforms,
-float skeletonScale,
 /*Defines the query inputs*/
 int frameIndex,
 int skeletonIndex,
+bool addRootOffset,
 /*Defines the query outputs*/
-vector<vec3>* jointPositions,
-unordered_map<string, vec3>* jointPositionsByName,
-vector<pair<vec3, vec3>>* segmentPositions,
-unordered_map<string, Transform>* cumulativeTransformsByName
+vec3* jointPositions,
+Transform* cumulativeTransforms,
+pair<vec3, vec3>* segmentPositions
 )
 {
-	vec3 jointPositionL = joint->GetLocalOffset();
-	vec3 jointPositionW = cumulativeTransform * vec4(jointPositionL[0], jointPositionL[1], jointPositionL[2], 1) * skeletonScale;
+	if (!jointPositions && !cumulativeTransforms && !segmentPositions)
+		return;
+
+	PoseSkeleton(ResolveFrame(frameIndex), skeletonIndex, addRootOffset, jointPositions, cumulativeTransforms, segmentPositions, true);
+}
+
+void SkeletalMotion::PoseSkeleton(int frameIndex,
+	int skeletonIndex,
+	bool addRootOffset,
+	vec3* jointPositions,
+	Transform* cumulativeTransforms,
+	pair<vec3, vec3>* segmentPositions,
+	bool memoize)
+{
+	const FlatSkeleton& skeleton = m_flatSkeleton;
+	int rootIndex = skeleton.rootIndices[skeletonIndex];
+	int subtreeEnd = skeleton.subtreeEnds[rootIndex];
+	int trackCount = skeleton.GetTrackCount();
 
-	if (cumulativeTransformsByName)
+	vec3 rootOrigin = addRootOffset ? m_rootPositions[frameIndex * m_skeletonRoots.size() + skeletonIndex] : vec3(0);
+	Transform rootTransform = Transform();
+	rootTransform.SetOrigin(rootOrigin);
+
+	if (m_storage != MOTION_STORAGE_QUATERNIONS)
 	{
-		if (cumulativeTransformsByName->find(joint->GetName()) == cumulativeTransformsByName->end())
-			cumulativeTransformsByName->emplace(joint->GetName(), cumulativeTransform);
-	}
+		// Transforms are composed straight from storage, other storages build the local transforms of the skeleton first
+		const Transform* localTransforms = m_transformFrames + (size_t)frameIndex * trackCount;
+		if (m_storage != MOTION_STORAGE_TRANSFORMS)
+		{
+			static thread_local vector<Transform> localTransformsBuffer;
+			localTransformsBuffer.resize(trackCount);
+			for (int jointIndex = rootIndex; jointIndex < subtreeEnd; jointIndex++)
+			{
+				int trackIndex = skeleton.trackIndices[jointIndex];
+				if (trackIndex >= 0)
+					localTransformsBuffer[trackIndex] = GetLocalTransform(trackIndex, frameIndex, memoize);
+			}
+			localTransforms = localTransformsBuffer.data();
+		}
 
-	if (jointPositions)
-		jointPositions->push_back(jointPositionW);
+		ComputeJointPoses(skeleton, rootIndex, rootTransform, localTransforms, m_skeletonScale, jointPositions, cumulativeTransforms, segmentPositions);
+		return;
+	}
 
-	if (jointPositionsByName)
+	// Quaternions are composed as such: rotations multiply, the local offset is rotated into the parent frame.
+	// Parents come first in the flat skeleton, so they are always computed by the time their children need them.
+	// Kept per thread so that queries do not allocate once warm, and stay safe to run concurrently.
+	static thread_local vector<quat>		childRotationsBuffer;
+	static thread_local vector<vec3>		childOriginsBuffer;
+	if (childRotationsBuffer.size() < subtreeEnd - rootIndex)
 	{
-		if (jointPositionsByName->find(joint->GetName()) == jointPositionsByName->end())
-			jointPositionsByName->emplace(joint->GetName(), jointPositionW);
+		childRotationsBuffer.resize(subtreeEnd - rootIndex);
+		childOriginsBuffer.resize(subtreeEnd - rootIndex);
 	}
 
-	Transform nextCumulativeTransform;
-	if (joint->GetDirectChildren().size()) // Leaf joints do not have transforms, let's not try looking for them
-		nextCumulativeTransform = cumulativeTransform * jointTransforms[joint->GetName()][frameIndex];
+	// Thread locals are reached through a call: they are only looked up once per query
+	quat* childRotations = childRotationsBuffer.data();
+	vec3* childOrigins = childOriginsBuffer.data();
 
-	for (auto child : joint->GetDirectChildren())
+	for (int jointIndex = rootIndex; jointIndex < subtreeEnd; jointIndex++)
 	{
-		if (segmentPositions)
-		{
-			vec3 childPositionL = child->GetLocalOffset();
-			vec3 childPositionW = nextCumulativeTransform * vec4(childPositionL[0], childPositionL[1], childPositionL[2], 1) * skeletonScale;
+		int parentSlot = skeleton.parentIndices[jointIndex] < 0 ? -1 : skeleton.parentIndices[jointIndex] - rootIndex;
+		int slot = jointIndex - rootIndex;
+		int trackIndex = skeleton.trackIndices[jointIndex];
+		const vec3& jointPositionL = skeleton.localOffsets[jointIndex];
+
+		quat cumulativeRotation = parentSlot < 0 ? quat() : childRotations[parentSlot];
+		vec3 cumulativeOrigin = parentSlot < 0 ? rootOrigin : childOrigins[parentSlot];
+
+		vec3 jointPositionW = (cumulativeOrigin + cumulativeRotation * jointPositionL) * m_skeletonScale;
 
-			segmentPositions->push_back(pair<vec3, vec3>(nextCumulativeTransform.GetOrigin() * skeletonScale, childPositionW));
+		if (trackIndex >= 0) // Leaf joints do not have transforms, let's not try looking for them
+		{
+			childRotations[slot] = cumulativeRotation * m_frameRotations[(size_t)frameIndex * trackCount + trackIndex];
+			childOrigins[slot] = cumulativeOrigin + cumulativeRotation * jointPositionL;
 		}
 
-		QuerySkeletalAnimationRecursive(
-			child,
-			nextCumulativeTransform,
-			jointTransforms,
-			skeletonScale,
-			frameIndex,
-			skeletonIndex,
-			jointPositions,
-			jointPositionsByName,
-			segmentPositions,
-			cumulativeTransformsByName);
-		
+		if (cumulativeTransforms)
+			cumulativeTransforms[jointIndex] = Transform(mat3_cast(cumulativeRotation), cumulativeOrigin);
+
+		if (segmentPositions && parentSlot >= 0)
+			segmentPositions[jointIndex] = pair<vec3, vec3>(cumulativeOrigin * m_skeletonScale, jointPositionW);
+
+		if (jointPositions)
+			jointPositions[jointIndex] = jointPositionW;
 	}
 }
 
@@ -189,29 +177,141 @@ unordered_map<string, Transform>* cumulativeTransformsByName
 	if (!jointPositions && !jointPositionsByName && !segmentPositions && !cumulativeTransformsByName)
 		return;
 
-	SkeletonJoint* root = m_skeletonRoots[skeletonIndex];
-
-	Transform rootTransform = Transform();
-
-	if (addRootOffset)
-		rootTransform.SetOrigin(m_rootTrajectories[frameIndex][skeletonIndex]);
+	const FlatSkeleton& skeleton = m_flatSkeleton;
+	int rootIndex = skeleton.rootIndices[skeletonIndex];
+	int subtreeEnd = skeleton.subtreeEnds[rootIndex];
 
-	// Build world pose of the skeleton by traversing the skeleton recursively and fetching joint rotation at the right frame.
-	// fills out provided containers while traversing
+	// Queried by joint index, then handed out in the requested containers
+	static thread_local vector<vec3>				positions;
+	static thread_local vector<Transform>			transforms;
+	static thread_local vector<pair<vec3, vec3>>	segments;
+	positions.resize(skeleton.GetJointCount());
+	transforms.resize(cumulativeTransformsByName ? skeleton.GetJointCount() : 0);
+	segments.resize(segmentPositions ? skeleton.GetJointCount() : 0);
 
-	QuerySkeletalAnimationRecursive
+	QuerySkeletalAnimation
 	(
-		root, 
-		rootTransform, 
-		m_jointTransforms,
-		m_skeletonScale,
-		frameIndex, 
+		frameIndex,
 		skeletonIndex,
-		jointPositions,
-		jointPositionsByName, 
-		segmentPositions,
-		cumulativeTransformsByName
+		addRootOffset,
+		positions.data(),
+		cumulativeTransformsByName ? transforms.data() : NULL,
+		segmentPositions ? segments.data() : NULL
 	);
+
+	for (int jointIndex = rootIndex; jointIndex < subtreeEnd; jointIndex++)
+	{
+		const string& jointName = skeleton.GetJointName(jointIndex);
+
+		if (cumulativeTransformsByName && cumulativeTransformsByName->find(jointName) == cumulativeTransformsByName->end())
+			cumulativeTransformsByName->emplace(jointName, transforms[jointIndex]);
+
+		if (segmentPositions && jointIndex != rootIndex)
+			segmentPositions->push_back(segments[jointIndex]);
+
+		if (jointPositions)
+			jointPositions->push_back(positions[jointIndex]);
+
+		if (jointPositionsByName && jointPositionsByName->find(jointName) == jointPositionsByName->end())
+			jointPositionsByName->emplace(jointName, positions[jointIndex]);
+	}
+}
+
+int SkeletalMotion::ComputeWorldPoses(int frameBegin,
+	int frameEnd,
+	int frameStride,
+	vec3* jointPositions,
+	Transform* cumulativeTransforms,
+	bool addRootOffset,
+	int threadCount)
+{
+	frameBegin = std::max(frameBegin, 0);
+	frameEnd = std::min(frameEnd, m_frameCount);
+	frameStride = std::max(frameStride, 1);
+	if (frameBegin >= frameEnd)
+		return 0;
+
+	int rowCount = (frameEnd - frameBegin + frameStride - 1) / frameStride;
+	if (!jointPositions && !cumulativeTransforms)
+		return rowCount;
+
+	size_t jointCount = m_flatSkeleton.GetJointCount();
+	size_t trackCount = m_flatSkeleton.GetTrackCount();
+	size_t rootCount = m_skeletonRoots.size();
+
+	// Poses rows [rowBegin, rowEnd): every skeleton of a frame lands in the same row, at its joint indices
+	auto poseRows = [&](int rowBegin, int rowEnd, bool lazy)
+	{
+		// Transforms can be read straight from storage, several frames at a time. Writing out cumulative transforms
+		// from every lane costs more than posing frame by frame, so only positions go through there.
+		// Blocks of rows are small enough that every skeleton fills them while they are still in cache.
+		if (m_storage == MOTION_STORAGE_TRANSFORMS && !lazy && !cumulativeTransforms)
+		{
+			for (int blockBegin = rowBegin; blockBegin < rowEnd; blockBegin += 64)
+			{
+				int blockEnd = std::min(blockBegin + 64, rowEnd);
+				size_t firstFrame = frameBegin + (size_t)blockBegin * frameStride;
+
+				for (int skeletonIndex = 0; skeletonIndex < rootCount; skeletonIndex++)
+				{
+					ComputeJointPosesFrames(m_flatSkeleton,
+						m_flatSkeleton.rootIndices[skeletonIndex],
+						blockEnd - blockBegin,
+						m_transformFrames + firstFrame * trackCount,
+						trackCount * frameStride,
+						addRootOffset ? m_rootPositions + firstFrame * rootCount + skeletonIndex : NULL,
+						rootCount * frameStride,
+						m_skeletonScale,
+						jointPositions ? jointPositions + blockBegin * jointCount : NULL,
+						cumulativeTransforms ? cumulativeTransforms + blockBegin * jointCount : NULL);
+				}
+			}
+			return;
+		}
+
+		for (int row = rowBegin; row < rowEnd; row++)
+		{
+			int frameIndex = frameBegin + row * frameStride;
+			int frameSlot = lazy ? ResolveFrame(frameIndex) : frameIndex;
+
+			for (int skeletonIndex = 0; skeletonIndex < m_skeletonRoots.size(); skeletonIndex++)
+			{
+				PoseSkeleton(frameSlot,
+					skeletonIndex,
+					addRootOffset,
+					jointPositions ? jointPositions + row * jointCount : NULL,
+					cumulativeTransforms ? cumulativeTransforms + row * jointCount : NULL,
+					NULL,
+					lazy);
+			}
+		}
+	};
+
+	// Lazily decoded frames go through the frame cache, which only one thread may use
+	if (m_cachedFrames.size())
+	{
+		poseRows(0, rowCount, true);
+		return rowCount;
+	}
+
+	// Frames only read the motion: rows are split in contiguous ranges, one per thread. Memoized rotations are left alone.
+	threadCount = threadCount > 0 ? threadCount : (int)thread::hardware_concurrency();
+	threadCount = std::max(1, std::min(threadCount, rowCount / 64));
+
+	vector<thread> workers;
+	for (int t = 1; t < threadCount; t++)
+	{
+		int rowBegin = (int)((int64_t)rowCount * t / threadCount);
+		int rowEnd = (int)((int64_t)rowCount * (t + 1) / threadCount);
+		workers.push_back(thread(poseRows, rowBegin, rowEnd, false));
+	}
+
+	poseRows(0, (int)((int64_t)rowCount / threadCount), false);
+
+	for (auto& worker : workers)
+		worker.join();
+
+	return rowCount;
 }
 
 void SkeletonJoint::QuerySkeleton(unordered_map<string, SkeletonJoint*>* jointPointersByNames, vector<pair<string, string>>* bonesByJointNames)
@@ -254,4 +354,138 @@ void SkeletalMotion::SetNormalizedScale()
 	SetNormalizedScaleWithMultiplier(1.0f);
 }
 
-SkeletalMotion::~SkeletalMotion() {}
+Transform SkeletalMotion::GetLocalTransform(int trackIndex, int frameSlot, bool memoize)
+{
+	size_t trackSlot = (size_t)frameSlot * m_flatSkeleton.GetTrackCount() + trackIndex;
+
+	if (m_storage == MOTION_STORAGE_EULER_ANGLES)
+	{
+		if (m_memoizedSlots[trackIndex] == frameSlot)
+			return m_memoizedTransforms[trackIndex];
+
+		vec3 localOffset = m_flatSkeleton.localOffsets[m_flatSkeleton.trackJoints[trackIndex]];
+		Transform localTransform(ComposeEulerRotation(&m_trackAxes[trackIndex * 3], m_frameEulerAngles[trackSlot]), localOffset);
+		if (m_memoizeRotations && memoize)
+		{
+			m_memoizedSlots[trackIndex] = frameSlot;
+			m_memoizedTransforms[trackIndex] = localTransform;
+		}
+		return localTransform;
+	}
+
+	if (m_storage == MOTION_STORAGE_QUATERNIONS)
+	{
+		vec3 localOffset = m_flatSkeleton.localOffsets[m_flatSkeleton.trackJoints[trackIndex]];
+		return Transform(mat3_cast(m_frameRotations[trackSlot]), localOffset);
+	}
+
+	return m_transformFrames[trackSlot];
+}
+
+void FlattenJointRecursive(SkeletonJoint* joint, int parentIndex, FlatSkeleton& skeleton)
+{
+	int jointIndex = skeleton.GetJointCount();
+
+	auto nameId = skeleton.jointIndicesByName.emplace(joint->GetName(), jointIndex);
+	if (nameId.second)
+	{
+		skeleton.nameIds.push_back((int)skeleton.names.size());
+		skeleton.names.push_back(joint->GetName());
+	}
+	else
+		skeleton.nameIds.push_back(skeleton.nameIds[nameId.first->second]);
+
+	skeleton.parentIndices.push_back(parentIndex);
+	skeleton.subtreeEnds.push_back(jointIndex + 1);
+	skeleton.localOffsets.push_back(joint->GetLocalOffset());
+	skeleton.joints.push_back(joint);
+
+	// Leaf joints do not have transforms
+	if (joint->GetDirectChildren().size())
+	{
+		skeleton.trackIndices.push_back(skeleton.GetTrackCount());
+		skeleton.trackJoints.push_back(jointIndex);
+	}
+	else
+		skeleton.trackIndices.push_back(-1);
+
+	for (auto child : joint->GetDirectChildren())
+		FlattenJointRecursive(child, jointIndex, skeleton);
+
+	skeleton.subtreeEnds[jointIndex] = skeleton.GetJointCount();
+}
+
+FlatSkeleton::FlatSkeleton(const vector<SkeletonJoint*>& skeletonRoots)
+{
+	for (auto root : skeletonRoots)
+	{
+		rootIndices.push_back(GetJointCount());
+		FlattenJointRecursive(root, -1, *this);
+	}
+}
+
+void SkeletalMotion::BindTracks()
+{
+	m_rootPositions = m_rootTrajectories.data();
+	m_transformFrames = m_frameTransforms.data();
+}
+
+void SkeletalMotion::SetChannelAxes(vector<int> channelAxes)
+{
+	m_channelAxes = move(channelAxes);
+	m_frameLayout = CompileFrameLayout(m_flatSkeleton, m_channelAxes);
+
+	// Tracks are numbered in line order
+	m_trackAxes.clear();
+	for (const FrameChannel& channel : m_frameLayout)
+	{
+		if (channel.kind == FRAME_CHANNEL_ROTATION)
+			m_trackAxes.insert(m_trackAxes.end(), channel.axes, channel.axes + 3);
+	}
+
+	m_memoizedSlots.assign(m_flatSkeleton.GetTrackCount(), -1);
+	m_memoizedTransforms.assign(m_flatSkeleton.GetTrackCount(), Transform());
+}
+
+vector<FrameChannel> CompileFrameLayout(const FlatSkeleton& skeleton, const vector<int>& channelAxes)
+{
+	vector<FrameChannel> frameLayout;
+
+	// Values follow the joints in depth first order: the position of each root, then the rotation of each joint with a track
+	int column = 0;
+	int skeletonIndex = 0;
+	for (int jointIndex = 0; jointIndex < skeleton.GetJointCount() && column + 3 <= channelAxes.size(); jointIndex++)
+	{
+		FrameChannel channel;
+		channel.jointIndex = jointIndex;
+
+		if (skeleton.parentIndices[jointIndex] < 0)
+		{
+			channel.kind = FRAME_CHANNEL_POSITION;
+			channel.column = column;
+			channel.target = skeletonIndex++;
+			copy(channelAxes.begin() + column, channelAxes.begin() + column + 3, channel.axes);
+			channel.order = EULER_ORDER_OTHER;
+			frameLayout.push_back(channel);
+			column += 3;
+		}
+
+		if (skeleton.trackIndices[jointIndex] >= 0 && column + 3 <= channelAxes.size())
+		{
+			channel.kind = FRAME_CHANNEL_ROTATION;
+			channel.column = column;
+			channel.target = skeleton.trackIndices[jointIndex];
+			copy(channelAxes.begin() + column, channelAxes.begin() + column + 3, channel.axes);
+			channel.order = GetEulerOrder(channel.axes);
+			frameLayout.push_back(channel);
+			column += 3;
+		}
+	}
+
+	return frameLayout;
+}
+
+SkeletalMotion::~SkeletalMotion()
+{
+	delete m_mappedFile;
+}
@@ -16,11 +16,19 @@
 	along with this program.If not, see <https://www.gnu.org/licenses/>.
 */
 
+#pragma once
+
 #include "../include/glm/glm.hpp"
+#include "../include/glm/gtc/quaternion.hpp"
 #include <string>
 #include <vector>
 #include <iostream>
 #include <unordered_map>
+#include <functional>
+#include <cstdint>
+#include "euler_Rotations.h"
+
+class FileMapping;
 
 using namespace std;
 using namespace glm;
@@ -31,38 +39,47 @@ using namespace glm;
 	This is the tree node that holds information about a specific joint. A skeleton is a tree of these things.
 */
 
+/*
+	Class Transform:
+
+	A rigid transform: a rotation followed by a translation to origin. Kept as the 3x3 rotation and the origin (the 3x4 affine
+	matrix, 48 bytes) rather than a 4x4 matrix whose last row is always (0, 0, 0, 1): composing two of them is 27 multiplies
+	instead of 64, and the origin is read as is.
+*/
 class Transform
 {
 public:
-	Transform();
-	Transform(mat3 rotation, vec3 origin);
-	~Transform();
+	Transform() : m_rotation(1), m_origin(0) {}
+	Transform(mat3 rotation, vec3 origin) : m_rotation(rotation), m_origin(origin) {}
 
 	void SetOrigin(vec3 origin);
 	void SetRotation(mat3 rotation);
 
-	vec3 GetOrigin();
-	mat3 GetRotation();
+	vec3 GetOrigin() const { return m_origin; }
+	mat3 GetRotation() const { return m_rotation; }
 
-	Transform GetInverse();
+	Transform GetInverse() const;
 
-	Transform Transform::operator*(const Transform& rhs) const
+	Transform operator*(const Transform& rhs) const
 	{
-		return Transform(this->m_transformMatrix * rhs.m_transformMatrix);
+		return Transform(m_rotation * rhs.m_rotation, m_rotation * rhs.m_origin + m_origin);
 	}
 
-	vec4 Transform::operator*(const vec4& rhs) const
+	vec4 operator*(const vec4& rhs) const
 	{
-		return m_transformMatrix * rhs;
+		return vec4(m_rotation * vec3(rhs) + m_origin * rhs.w, rhs.w);
 	}
 
-	vec3 Rotate(vec3 direction) { return vec3(*this*vec4(direction, 0)); }
+	vec3 Rotate(vec3 direction) const { return m_rotation * direction; }
 
-	vec3 TransformPoint(vec3 point) { return vec3(*this*vec4(point, 1)); }
+	vec3 TransformPoint(vec3 point) const { return m_rotation * point + m_origin; }
+
+	// The 12 values of the transform: the rotation columns, then the origin
+	const float* GetData() const { return &m_rotation[0][0]; }
 
 private:
-	Transform(mat4 transformMatrix) { m_transformMatrix = transformMatrix; }
-	mat4 m_transformMatrix;
+	mat3 m_rotation;
+	vec3 m_origin;
 };
 
 class SkeletonJoint
@@ -78,7 +95,7 @@ public:
 
 	~SkeletonJoint() {};
 
-	string		GetName()			{ return m_name; }
+	const string&	GetName()		{ return m_name; }
 	
 	vec3		GetLocalOffset()	{ return m_localOffset; }
 
@@ -88,7 +105,7 @@ public:
 		Returns a vector of pointers to all the direct descendance of this joint.
 		An end joint will return a empty vector.
 	*/
-	vector<SkeletonJoint*> GetDirectChildren()	{ return m_childJoints; }
+	const vector<SkeletonJoint*>& GetDirectChildren()	{ return m_childJoints; }
 
 	/*
 		QuerySkeleton:
@@ -105,25 +122,206 @@ private:
 	vector<SkeletonJoint*>	m_childJoints;
 };
 
+/*
+	Struct FlatSkeleton:
+
+	The joints of all the skeletons of a motion in depth first order, one array per attribute: each root is followed by its descendants,
+	so parents always come before their children and a single pass over the arrays visits the skeleton top down.
+	The descendants of joint i are the joints i + 1 to subtreeEnds[i] - 1, a joint without descendants is a leaf.
+	The SkeletonJoint trees stay the way to browse a skeleton: joints[i] is the node of joint i.
+	Every joint with children has a track (its local transforms over time), numbered in the same order; leaves have none.
+	Built when the motion is created, later changes to the nodes (ApplyOffsetNormalization) are not reflected.
+*/
+struct FlatSkeleton
+{
+	FlatSkeleton() {}
+	FlatSkeleton(const vector<SkeletonJoint*>& skeletonRoots);
+
+	vector<int>				parentIndices;		// -1 for roots
+	vector<int>				subtreeEnds;
+	vector<vec3>			localOffsets;
+	vector<int>				nameIds;			// Index in names, joints sharing a name share an id
+	vector<string>			names;
+	vector<SkeletonJoint*>	joints;
+	vector<int>				rootIndices;		// Joint index of each skeleton root
+	vector<int>				trackIndices;		// -1 for leaves
+	vector<int>				trackJoints;		// Joint index of each track
+	unordered_map<string, int>	jointIndicesByName;	// First joint of each name
+
+	int GetJointCount() const { return (int)parentIndices.size(); }
+	int GetTrackCount() const { return (int)trackJoints.size(); }
+	const string& GetJointName(int jointIndex) const { return names[nameIds[jointIndex]]; }
+
+	// Index of the first joint called jointName, -1 if there is none
+	int FindJoint(const string& jointName) const
+	{
+		auto joint = jointIndicesByName.find(jointName);
+		return joint == jointIndicesByName.end() ? -1 : joint->second;
+	}
+};
+
+/*
+	Struct JointHandle:
+
+	A joint found once by name (see SkeletalMotion::FindJoint), to be queried every frame without looking its name up again.
+	It is the index of the joint in the FlatSkeleton, and stays valid for as long as the motion lives.
+*/
+struct JointHandle
+{
+	JointHandle() : jointIndex(-1) {}
+	explicit JointHandle(int index) : jointIndex(index) {}
+
+	bool IsValid() const { return jointIndex >= 0; }
+
+	int jointIndex;
+};
+
+/*
+	Struct FrameChannel:
+
+	One step of decoding a frame line. The layout of the line is fixed by the HIERARCHY: it is compiled once (see CompileFrameLayout)
+	into an entry per root position and per track rotation, each reading three consecutive values, so that a line decodes
+	in a single pass over the entries, without looking joints up or walking the skeleton.
+*/
+enum FrameChannelKind
+{
+	FRAME_CHANNEL_POSITION,		// Position of a root
+	FRAME_CHANNEL_ROTATION		// Rotation channels of a track
+};
+
+struct FrameChannel
+{
+	FrameChannelKind	kind;
+	int					column;		// First of the three values in the line
+	int					jointIndex;
+	int					target;		// Skeleton index of a position, track index of a rotation
+	int					axes[3];	// Axis of each value
+	EulerOrder			order;		// Of the rotation channels
+};
+
+// Frame line layout of a skeleton, from the axis of each value of the line (see SkeletalMotion::SetChannelAxes)
+vector<FrameChannel> CompileFrameLayout(const FlatSkeleton& skeleton, const vector<int>& channelAxes);
+
+/*
+	MotionStorage:
+
+	How a SkeletalMotion keeps the local transforms of its joints.
+*/
+enum MotionStorage
+{
+	MOTION_STORAGE_TRANSFORMS,		// A Transform (48 bytes) per joint per frame, ready to be composed
+	MOTION_STORAGE_EULER_ANGLES,	// The three rotation channels (12 bytes) per joint per frame, rotations are built when queried
+	MOTION_STORAGE_QUATERNIONS		// A quaternion (16 bytes) per joint per frame, converted once at import; FK composes quaternions
+};
+
+/*
+	Struct BVHImportOptions:
+
+	Tweaks how BVHImport reads a file. The defaults import the whole clip on the calling thread.
+*/
+struct BVHImportOptions
+{
+	BVHImportOptions() : threadCount(1), lazyDecoding(false), lazyCacheSize(16), useBinaryCache(false), storage(MOTION_STORAGE_TRANSFORMS), memoizeRotations(false),
+		frameBegin(0), frameEnd(-1), frameStride(1) {}
+
+	/*
+		Number of threads decoding the MOTION block. 0 uses one thread per hardware thread.
+		Frames are split between threads when the file holds one frame per line (which every exporter we know of does).
+	*/
+	int threadCount;
+
+	/*
+		Only index the frame lines at import, and decode frames when they are first queried.
+		The file stays mapped for as long as the motion lives, and the lazyCacheSize most recently used frames are kept decoded.
+		Queries then modify the cache: a lazily decoded motion should not be queried from several threads at once.
+	*/
+	bool lazyDecoding;
+	int lazyCacheSize;
+
+	/*
+		Keep a binary copy of the clip next to the file (<file>.cbvh, see CBVHExport) and load that instead whenever
+		it was built from the same file content. Imports that have to (re)build the cache ignore lazyDecoding.
+	*/
+	bool useBinaryCache;
+
+	/*
+		How frames are kept in memory. MOTION_STORAGE_EULER_ANGLES takes about a fifth of the memory, for a rotation
+		built per joint per query. MOTION_STORAGE_QUATERNIONS takes a quarter of it, and is the cheapest to interpolate or blend.
+		With memoizeRotations, each joint keeps the last rotation it built, so querying
+		the same frame again (other outputs, other skeleton) costs no rotation at all; queries then modify the motion.
+		Binary caches always hold transforms.
+	*/
+	MotionStorage storage;
+	bool memoizeRotations;
+
+	/*
+		Only import part of the file: values that are not asked for are skipped without being parsed.
+		jointNames lists the joints to keep, along with their ancestors (empty keeps them all). The other joints are left out
+		of the skeletons, and skeletons without any joint to keep are left out whole. A kept joint whose children are all
+		left out becomes a leaf: its position is kept, not its rotation.
+		Frames frameBegin, frameBegin + frameStride... before frameEnd (-1 for the end of the clip) are kept, and become
+		frames 0, 1... of the motion; the sampling rate is divided by frameStride.
+		Partial imports neither read nor write binary caches.
+	*/
+	vector<string> jointNames;
+	int frameBegin;
+	int frameEnd;
+	int frameStride;
+};
+
+/*
+	Struct BVHInfo:
+
+	What SkeletalMotion::ProbeBVH reads of a file: everything but the frames.
+*/
+struct BVHInfo
+{
+	FlatSkeleton			skeleton;			// Joint names, parents and offsets; the SkeletonJoint nodes are not kept (joints is empty)
+	vector<FrameChannel>	frameLayout;		// What the values of a frame line are, see CompileFrameLayout
+	int						frameChannelCount;	// Values per frame line
+	int						frameCount;
+	float					samplingRate;		// Frames per second, as SkeletalMotion::GetSamplingRate
+	uint64_t				motionOffset;		// Where the frame values start in the file
+};
+
+/*
+	BVHFrameSink:
+	Receives the frames of BVHStreamImport one at a time, as they are decoded: the root position of every skeleton,
+	and the local transform of every joint by name (as GetLocalTransformByName would return them).
+	The containers are reused from one frame to the next. Return false to stop the import.
+*/
+typedef function<bool(int frameIndex, const vector<vec3>& rootPositions, const unordered_map<string, Transform>& localTransforms)> BVHFrameSink;
+
 class SkeletalMotion
 {
 public:
 
+	/*
+		Frames are stored frame after frame: rootTrajectories holds the root position of every skeleton for frame 0, then frame 1...
+		and frameTransforms the local transform of every track (see FlatSkeleton) for frame 0, then frame 1...
+	*/
 	SkeletalMotion(
 		string name,
-		vector<vector<vec3>> rootTrajectories,
-		unordered_map<string, vector<Transform>> jointTransforms,
+		vector<vec3> rootTrajectories,
+		vector<Transform> frameTransforms,
 		vector<SkeletonJoint*> skeletonRoots,
 		float samplingRate,
 		int	  frameCount)
 	{
 		m_name = name;
-		m_rootTrajectories = rootTrajectories;
-		m_jointTransforms = jointTransforms;
+		m_rootTrajectories = move(rootTrajectories);
+		m_frameTransforms = move(frameTransforms);
 		m_skeletonRoots = skeletonRoots;
+		m_flatSkeleton = FlatSkeleton(skeletonRoots);
 		m_samplingRate = samplingRate;
 		m_frameCount = frameCount;
 		m_skeletonScale = 1.0f;
+		m_mappedFile = NULL;
+		m_cacheClock = 0;
+		m_storage = MOTION_STORAGE_TRANSFORMS;
+		m_memoizeRotations = false;
+
+		BindTracks();
 	};
 
 	~SkeletalMotion();
@@ -146,10 +344,16 @@ public:
 	*/
 	SkeletonJoint* GetRoot(int index){ return m_skeletonRoots[index]; }
 
+	/*
+		Returns the skeletons as flat arrays, see FlatSkeleton.
+	*/
+	const FlatSkeleton& GetFlatSkeleton() { return m_flatSkeleton; }
+
 	/*
 		QuerySkeletalAnimation:
 		Use this function to retrieve information about the pose of an animation at a frameIndex, in the required formats.
 		Careful there... this traverses the skeleton and assembles the full pose. Call only once a frame if possible <3.
+		Joints are visited in the order of the FlatSkeleton, which is the depth first order of the SkeletonJoint tree.
 	*/
 	void QuerySkeletalAnimation
 	(
@@ -164,6 +368,42 @@ public:
 		unordered_map<string, Transform>* cumulativeTransformsByName = NULL
 	);
 
+	/*
+		Same query, written into arrays of GetFlatSkeleton().GetJointCount() elements indexed by joint index. Only the entries of
+		the joints of the queried skeleton are written. segmentPositions[i] is the segment from the parent of joint i to joint i
+		(roots have none). Outputs may be null. Nothing is allocated once a thread has queried a skeleton that large.
+	*/
+	void QuerySkeletalAnimation
+	(
+		/*Defines the query inputs*/
+		int frameIndex,
+		int skeletonIndex,
+		bool addRootOffset,
+		/*Defines the query outputs*/
+		vec3* jointPositions,
+		Transform* cumulativeTransforms,
+		pair<vec3, vec3>* segmentPositions
+	);
+
+	/*
+		ComputeWorldPoses:
+		Poses every skeleton at frames frameBegin, frameBegin + frameStride, ... below frameEnd, all in one call.
+		Row r of the outputs is frame frameBegin + r * frameStride: GetFlatSkeleton().GetJointCount() entries indexed by joint index,
+		so the outputs hold one row per frame posed, back to back. Outputs may be null.
+		Frames are split between threadCount threads (0 uses one per hardware thread), lazily decoded motions are posed on the calling thread.
+		Returns the number of rows written.
+	*/
+	int ComputeWorldPoses
+	(
+		int frameBegin,
+		int frameEnd,
+		int frameStride,
+		vec3* jointPositions,
+		Transform* cumulativeTransforms = NULL,
+		bool addRootOffset = true,
+		int threadCount = 0
+	);
+
 	/*
 		Compute and set a normalizing scale so that differnt skeleton definition appear at the same scale in the application
 	*/
@@ -179,31 +419,154 @@ public:
 	*/
 	void SetScale(float scale) { m_skeletonScale = scale; }
 
+	/*
+		Returns a handle to the first joint called jointName, or an invalid handle if there is none.
+		Look joints up once and keep the handles: the accessors taking them do not touch names.
+	*/
+	JointHandle FindJoint(const string& jointName) { return JointHandle(m_flatSkeleton.FindJoint(jointName)); }
+
+	/*
+		Queries the local transform of a joint, for a specific frame index. Leaves and invalid handles get the identity.
+	*/
+	Transform GetLocalTransformByHandle(JointHandle joint, int frameIndex)
+	{
+		if (!joint.IsValid() || joint.jointIndex >= m_flatSkeleton.GetJointCount() || m_flatSkeleton.trackIndices[joint.jointIndex] < 0)
+			return Transform();
+
+		return GetLocalTransform(m_flatSkeleton.trackIndices[joint.jointIndex], ResolveFrame(frameIndex));
+	}
+
 	/*
 		Queries the local transform of a joint using it's name, for a specific frame index.
+		This looks the name up on every call, see FindJoint and GetLocalTransformByHandle.
 	*/
 	Transform GetLocalTransformByName(std::string name, int frameIndex) 
 	{
-		Transform tr = m_jointTransforms[name][frameIndex];
+		Transform tr = GetLocalTransformByHandle(FindJoint(name), frameIndex);
 		return tr;
 	}
 
 private:
 	string m_name;
-	vector<vector<vec3>>			m_rootTrajectories;
-	unordered_map < string,
-		vector < Transform >>		m_jointTransforms;
+	vector<vec3>					m_rootTrajectories;		// Root positions of all skeletons, [frame * rootCount + rootIndex]
+	vector<Transform>				m_frameTransforms;		// Local transforms of all tracks, [frame * trackCount + trackIndex]
+
+	/*
+		What queries actually read: the storage above, or arrays of a mapped binary cache (see CBVHImport).
+	*/
+	void BindTracks();
+
+	const vec3*						m_rootPositions;
+	const Transform*				m_transformFrames;
+
+	/*
+		The other storages keep rotations instead of the transforms above, in the same [frame * trackCount + trackIndex] layout.
+		m_trackAxes holds the rotation axes of each track, in the order of its CHANNELS line ([trackIndex * 3 + r]).
+	*/
+	MotionStorage					m_storage;
+	vector<vec3>					m_frameEulerAngles;		// MOTION_STORAGE_EULER_ANGLES, in degrees
+	vector<quat>					m_frameRotations;		// MOTION_STORAGE_QUATERNIONS
+	vector<int>						m_trackAxes;
+	bool							m_memoizeRotations;
+	vector<int>						m_memoizedSlots;		// Last local transform built by each track (see BVHImportOptions::memoizeRotations)
+	vector<Transform>				m_memoizedTransforms;
+
+	// Local transform of a track at a frame slot (frame index, or cache slot when lazily decoded), whatever the storage.
+	// Without memoize, memoized rotations are read but never written, so that several threads can build transforms at once.
+	Transform GetLocalTransform(int trackIndex, int frameSlot, bool memoize = true);
+
+	// QuerySkeletalAnimation once the frame is resolved to its slot.
+	void PoseSkeleton(int frameIndex,
+		int skeletonIndex,
+		bool addRootOffset,
+		vec3* jointPositions,
+		Transform* cumulativeTransforms,
+		pair<vec3, vec3>* segmentPositions,
+		bool memoize);
 
 	vector<SkeletonJoint*>			m_skeletonRoots;
+	FlatSkeleton					m_flatSkeleton;
 	float							m_samplingRate;
 	int								m_frameCount;
 	float							m_skeletonScale;
+
+	/*
+		Lazy decoding (see BVHImportOptions::lazyDecoding): the tracks above only hold a few cached frames,
+		the others are decoded from the mapped file when they are first asked for.
+	*/
+	int ResolveFrame(int frameIndex);
+
+	FileMapping*						m_mappedFile;			// Lazily decoded BVH file, or binary cache the tracks point into
+	vector<uint64_t>					m_frameOffsets;			// Frame i is the line starting at m_frameOffsets[i] of the file
+	vector<float>						m_frameValues;
+	vector<int>							m_columnRuns;			// Which values of a line are imported, see BVHImportOptions::jointNames
+	vector<int>							m_cachedFrames;			// Frame decoded in each cache slot, -1 if none
+	vector<uint64_t>					m_cachedFramesLastUse;
+	uint64_t							m_cacheClock;
+
+	/*
+		Axis of each value of a frame line, in file order: the three position channels of a root, followed by the three rotation
+		channels of each track of its skeleton. Also sets m_trackAxes and m_frameLayout.
+	*/
+	void SetChannelAxes(vector<int> channelAxes);
+
+	vector<int>							m_channelAxes;
+	vector<FrameChannel>				m_frameLayout;
+
+	// BVHImport from bvhDataSize bytes at bvhData, which lie in mappedFile (taken over, NULL if the data is the caller's).
+	static SkeletalMotion* BVHImportData(string bvhName, const char* bvhData, size_t bvhDataSize, const BVHImportOptions& options, FileMapping* mappedFile);
 public:
 
 	/*
 		BVHImport: 
 		Creates a SkeletalMotion object on the heap and returns a pointer to it.
 		Input a valide file path and things should be alright.
+		Files compressed with gzip or zstd (.bvh.gz, .bvh.zst) are decompressed into memory as they are read, see FileReader.
+		They are decoded on import, like buffers below: lazy decoding and binary caches need the text on disk.
+	*/
+	static SkeletalMotion* BVHImport(string bvhFilePath, const BVHImportOptions& options = BVHImportOptions());
+
+	/*
+		Same as above, for a BVH file already in memory (pack files, network caches...): values are parsed straight from
+		the bvhDataSize bytes at bvhData, which only need to stay valid until the call returns. Without a file to keep
+		open or to key it, neither lazy decoding nor binary caches are available: frames are decoded on import.
+	*/
+	static SkeletalMotion* BVHImport(const char* bvhData, size_t bvhDataSize, const BVHImportOptions& options = BVHImportOptions());
+
+	/*
+		Same as above, for a BVH file read from bvhStream (from its current position to its end), in one read when the stream
+		can tell its size.
+	*/
+	static SkeletalMotion* BVHImport(istream& bvhStream, const BVHImportOptions& options = BVHImportOptions());
+
+	/*
+		BVHStreamImport:
+		Reads the file chunkSize bytes at a time instead of mapping it whole, for files that do not fit in memory or address space.
+		Compressed files are decompressed chunk by chunk as well, so they never are whole in memory either.
+		Without a sink, frames are stored in the returned motion as they are decoded, like BVHImport does.
+		With a sink, frames are handed to it and not stored: the returned motion carries the skeleton only (no frames).
+	*/
+	static SkeletalMotion* BVHStreamImport(string bvhFilePath, const BVHFrameSink& frameSink = nullptr, size_t chunkSize = 1 << 20);
+
+	/*
+		ProbeBVH:
+		Reads the header of a file (HIERARCHY, frame count and frame time) into info, without reading the MOTION block
+		past the chunk the header ends in. Meant for scanning many files: nothing is printed.
+		Returns false if the file cannot be opened or its header is malformed.
+	*/
+	static bool ProbeBVH(string bvhFilePath, BVHInfo* info);
+
+	/*
+		CBVHExport:
+		Writes the motion to a binary cache file that CBVHImport can map back. sourceHash identifies the content it was built from.
+		Lazily decoded motions cannot be exported.
+	*/
+	bool CBVHExport(string cbvhFilePath, uint64_t sourceHash = 0);
+
+	/*
+		CBVHImport:
+		Maps a binary cache written by CBVHExport. The motion reads its frames straight from the mapping, nothing is decoded.
+		Returns a null pointer if the file is not a valid cache, or (when expectedSourceHash is not 0) was built from other content.
 	*/
-	static SkeletalMotion* BVHImport(string bvhFilePath);
+	static SkeletalMotion* CBVHImport(string cbvhFilePath, uint64_t expectedSourceHash = 0);
 };
\ No newline at end of file
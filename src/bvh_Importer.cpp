@@ -16,17 +16,24 @@
 	along with this program.If not, see <https://www.gnu.org/licenses/>.
 */
 
-#include <fstream>
 #include <iostream>
 #include <string.h>
+#include <string_view>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <charconv>
+#include <unordered_set>
 #include "animation.h"
+#include "file_Mapping.h"
+#include "file_Reader.h"
+#include "number_Parsing.h"
+#include "euler_Rotations.h"
 
 #define _HAS_ITERATOR_DEBUGGING 0
 
-#ifndef M_PI
-#define M_PI       3.14159265358979323846f
-#endif
-
 using namespace std;
 
 void InvalidBVH()
@@ -36,289 +43,920 @@ void InvalidBVH()
 
 #define INVALID_BVH {InvalidBVH(); return NULL;}
 
-// Helper that gets Which rotation matrix we should output for each axis
-mat3 GetRotationMatrix(int axis, float angle);
 // Helper that turns a bunch of string parameters from a bvh to int values
-int ChannelOrderToInt(string str);
+int ChannelOrderToInt(string_view str);
+// Content hash keying binary caches, see cbvh_Cache.cpp
+uint64_t HashBVHContent(const char* data, uint64_t size);
 
-// Turns a big string file into a big bunch of tokens (splits with special characters)
-void tokenize(vector<string>& tokens, string str)
+// Words are not NUL terminated (they point straight into the file buffer), so atof/atoi are off the table.
+float ParseFloat(string_view token)
 {
-	string token = "";
-	for (int i = 0; i < str.length(); i++)
-	{
-		if (i == str.length() - 1)
-		{
-			char a = str[i];
-		}
+	float value = 0;
+	ParseFloatRowScalar(token.data(), token.data() + token.size(), &value, 1);
+	return value;
+}
 
-		if (str[i] == '\0' || str[i] == '\n' || str[i] == ' ' || str[i] == '\r' || str[i] == '\t' || str[i] < 0)
-		{
-			if (token.length() > 0)
-				tokens.push_back(token);
+int ParseInt(string_view token)
+{
+	int value = 0;
+	from_chars(token.data(), token.data() + token.size(), value);
+	return value;
+}
 
-			token = "";
-		}
-		else
-		{
-			token += str[i];
-		}
+// Print the Skeleton to the console
+void PrintSkeletons(const vector<SkeletonJoint*>& skeletalRoots)
+{
+	std::cout << "Loaded the following Skeleton: \n\n";
+	for (auto roots : skeletalRoots)
+	{
+		roots->PrintJoint();
 	}
 }
 
-// See BVHImport for explanation
-SkeletonJoint* ParseJoint(vector<string> &tokens, int startToken, int* endToken, unordered_map<string, vector<int>> &jointChannelsOrderings)
+// Joint trees are not owned by their nodes: joints of an import that failed are deleted with this
+void DeleteJointRecursive(SkeletonJoint* joint)
 {
-	if (tokens[startToken + 2].compare("{"))
+	for (auto child : joint->GetDirectChildren())
+		DeleteJointRecursive(child);
+	delete joint;
+}
+
+/*
+	Class BVHHeaderParser:
+
+	Reads the HIERARCHY and the MOTION header (up to the frame time) straight from the file buffer, in a single pass.
+	Each word is handled according to the state the parser is in, and the joints being read are kept on a stack:
+	nothing of the text is kept but the skeleton. Parse can be called again as more of the file comes in, it resumes
+	at the first word it could not finish (the buffer may move, but has to start with what was passed before).
+*/
+class BVHHeaderParser
+{
+public:
+	enum Result
 	{
-		INVALID_BVH
-	}
+		PARSED,
+		INCOMPLETE,		// The header goes on past the end of the buffer
+		INVALID
+	};
+
+	BVHHeaderParser() : frameCount(0), frameTime(0), motionOffset(0), verbose(true), m_state(STATE_HIERARCHY), m_wordIndex(0), m_channelCount(0), m_offset(0) {}
 
-	if (tokens[startToken + 3].compare("OFFSET"))
+	// The skeletons are deleted with the parser, unless the caller takes them out of skeletalRoots (see SkeletalMotion)
+	~BVHHeaderParser()
 	{
-		INVALID_BVH
+		for (auto root : skeletalRoots)
+			DeleteJointRecursive(root);
+
+		for (auto& joint : m_joints)
+		{
+			for (auto child : joint.children)
+				DeleteJointRecursive(child);
+		}
 	}
 
-	string jointName = tokens[startToken + 1];
-	vec3 jointLocalOffset = vec3
-	(
-		atof(tokens[startToken + 4].c_str()),
-		atof(tokens[startToken + 5].c_str()),
-		atof(tokens[startToken + 6].c_str())
-	);
+	// Parses the words of [buffer + already parsed, buffer + length). Without endOfData, a word running to the end of the buffer may be cut.
+	Result Parse(const char* buffer, size_t length, bool endOfData);
 
-	vector<SkeletonJoint*> jointChildren;
+	vector<SkeletonJoint*>				skeletalRoots;
+	unordered_map<string, vector<int>>	jointChannelsOrderings;
+	int									frameCount;
+	float								frameTime;
+	size_t								motionOffset;	// Where the frame values start
+	bool								verbose;		// Reports the words of joint bodies it skips on cout
 
-	if (tokens[startToken + 7].compare("CHANNELS"))
+private:
+	enum State
 	{
-		INVALID_BVH
-	}
-
-	int currentToken;
-	if (!tokens[startToken + 8].compare("3"))
+		STATE_HIERARCHY,		// "HIERARCHY"
+		STATE_ROOTS,			// "ROOT" or "MOTION", other words are skipped
+		STATE_JOINT_NAME,
+		STATE_JOINT_OPEN,		// "{"
+		STATE_OFFSET,			// "OFFSET"
+		STATE_OFFSET_VALUES,
+		STATE_CHANNELS,			// "CHANNELS"
+		STATE_CHANNEL_COUNT,	// 3 or 6
+		STATE_CHANNEL_NAMES,
+		STATE_JOINT_BODY,		// "JOINT", "End Site" or "}", other words are skipped
+		STATE_END_SITE,			// "Site { OFFSET x y z }"
+		STATE_FRAMES,			// "Frames:"
+		STATE_FRAME_COUNT,
+		STATE_FRAME_TIME,		// "Frame Time:"
+		STATE_FRAME_TIME_VALUE,
+		STATE_DONE
+	};
+
+	// A joint whose closing brace has not been read yet
+	struct OpenJoint
 	{
-		currentToken = startToken + 12;
-		
-		jointChannelsOrderings[jointName] = vector<int>({ ChannelOrderToInt(tokens[startToken + 9]),
-			ChannelOrderToInt(tokens[startToken + 10]),
-			ChannelOrderToInt(tokens[startToken + 11]) });
+		string					name;
+		vec3					localOffset;
+		vector<int>				channels;
+		vector<SkeletonJoint*>	children;
+	};
+
+	// Handles a word, returns false if it does not belong there
+	bool ReadWord(string_view word);
+
+	State				m_state;
+	int					m_wordIndex;	// Of a multiple word state
+	int					m_channelCount;
+	vector<OpenJoint>	m_joints;
+	size_t				m_offset;
+};
+
+BVHHeaderParser::Result BVHHeaderParser::Parse(const char* buffer, size_t length, bool endOfData)
+{
+	const char* end = buffer + length;
+	const char* cursor = buffer + m_offset;
 
-	}
-	else if (!tokens[startToken + 8].compare("6"))
+	while (m_state != STATE_DONE)
 	{
-		currentToken = startToken + 15;
+		const char* word = SkipTokenSeparators(cursor, end);
+		const char* wordEnd = word;
+		while (wordEnd < end && !IsTokenSeparator(*wordEnd))
+			wordEnd++;
 
-		jointChannelsOrderings[jointName] = vector<int>({ ChannelOrderToInt(tokens[startToken + 9]),
-			ChannelOrderToInt(tokens[startToken + 10]),
-			ChannelOrderToInt(tokens[startToken + 11]),
-			ChannelOrderToInt(tokens[startToken + 12]),
-			ChannelOrderToInt(tokens[startToken + 13]),
-			ChannelOrderToInt(tokens[startToken + 14])});
-	}
-	else
-	{
-		INVALID_BVH
+		if (word == end || (wordEnd == end && !endOfData))
+		{
+			m_offset = cursor - buffer;
+			return endOfData ? INVALID : INCOMPLETE;
+		}
+
+		if (!ReadWord(string_view(word, wordEnd - word)))
+			return INVALID;
+
+		cursor = wordEnd;
 	}
 
-	// Now to read the child joints ...
-	while (tokens[currentToken].compare("}"))
+	m_offset = cursor - buffer;
+	motionOffset = m_offset;
+
+	return frameCount >= 0 ? PARSED : INVALID;
+}
+
+bool BVHHeaderParser::ReadWord(string_view word)
+{
+	switch (m_state)
 	{
-		if (!tokens[currentToken].compare("JOINT"))
+	case STATE_HIERARCHY:
+		m_state = STATE_ROOTS;
+		return word == "HIERARCHY";
+
+	case STATE_ROOTS:
+		if (word == "ROOT")
+			m_state = STATE_JOINT_NAME;
+		else if (word == "MOTION")
+			m_state = STATE_FRAMES;
+		return true;
+
+	case STATE_JOINT_NAME:
+		m_joints.push_back(OpenJoint());
+		m_joints.back().name = string(word);
+		m_state = STATE_JOINT_OPEN;
+		return true;
+
+	case STATE_JOINT_OPEN:
+		m_state = STATE_OFFSET;
+		return word == "{";
+
+	case STATE_OFFSET:
+		m_state = STATE_OFFSET_VALUES;
+		m_wordIndex = 0;
+		return word == "OFFSET";
+
+	case STATE_OFFSET_VALUES:
+		m_joints.back().localOffset[m_wordIndex++] = ParseFloat(word);
+		if (m_wordIndex == 3)
+			m_state = STATE_CHANNELS;
+		return true;
+
+	case STATE_CHANNELS:
+		m_state = STATE_CHANNEL_COUNT;
+		return word == "CHANNELS";
+
+	case STATE_CHANNEL_COUNT:
+		m_channelCount = word == "3" ? 3 : word == "6" ? 6 : 0;
+		m_state = STATE_CHANNEL_NAMES;
+		return m_channelCount != 0;
+
+	case STATE_CHANNEL_NAMES:
+		m_joints.back().channels.push_back(ChannelOrderToInt(word));
+		if (m_joints.back().channels.size() == m_channelCount)
 		{
-			int currentEndToken = -1;
-			SkeletonJoint* childJoint = ParseJoint(tokens, currentToken, &currentEndToken, jointChannelsOrderings);
-			if (childJoint)
-			{
-				jointChildren.push_back(childJoint);
-				currentToken = currentEndToken + 1;
-			}
+			jointChannelsOrderings[m_joints.back().name] = m_joints.back().channels;
+			m_state = STATE_JOINT_BODY;
+		}
+		return true;
+
+	case STATE_JOINT_BODY:
+		if (word == "JOINT")
+		{
+			m_state = STATE_JOINT_NAME;
 		}
-		else if (!tokens[currentToken].compare("End") && !tokens[currentToken + 1].compare("Site"))
+		else if (word == "End")
 		{
-			if (!tokens[currentToken + 2].compare("{") && !tokens[currentToken + 3].compare("OFFSET") && !tokens[currentToken + 7].compare("}"))
+			m_state = STATE_END_SITE;
+			m_wordIndex = 0;
+		}
+		else if (word == "}")
+		{
+			OpenJoint& joint = m_joints.back();
+			SkeletonJoint* closedJoint = new SkeletonJoint(joint.name, joint.children, joint.localOffset);
+			m_joints.pop_back();
+
+			if (m_joints.size())
 			{
-				string endJointName = jointName + "_end";
-				vec3 endJointLocalOffset = vec3
-				(
-					atof(tokens[startToken + 4].c_str()),
-					atof(tokens[startToken + 5].c_str()),
-					atof(tokens[startToken + 6].c_str())
-				);
-				
-				SkeletonJoint* endJoint = new SkeletonJoint(endJointName, vector<SkeletonJoint*>(), endJointLocalOffset);
-
-				jointChildren.push_back(endJoint);
-				currentToken += 8;
+				m_joints.back().children.push_back(closedJoint);
 			}
 			else
 			{
-				INVALID_BVH
-					currentToken++;
+				skeletalRoots.push_back(closedJoint);
+				m_state = STATE_ROOTS;
 			}
 		}
-		else
+		else if (verbose)
+		{
+			cout << "Doing nothing for token " << word << "\n";
+		}
+		return true;
+
+	case STATE_END_SITE:
+	{
+		// The values of the OFFSET are not read: end sites have always been given the offset of their joint
+		static const char* endSiteWords[7] = { "Site", "{", "OFFSET", NULL, NULL, NULL, "}" };
+		const char* expectedWord = endSiteWords[m_wordIndex++];
+		if (expectedWord && word != expectedWord)
+			return false;
+
+		if (m_wordIndex == 7)
+		{
+			OpenJoint& joint = m_joints.back();
+			joint.children.push_back(new SkeletonJoint(joint.name + "_end", vector<SkeletonJoint*>(), joint.localOffset));
+			m_state = STATE_JOINT_BODY;
+		}
+		return true;
+	}
+
+	case STATE_FRAMES:
+		m_state = STATE_FRAME_COUNT;
+		return word == "Frames:";
+
+	case STATE_FRAME_COUNT:
+		frameCount = ParseInt(word);
+		m_state = STATE_FRAME_TIME;
+		m_wordIndex = 0;
+		return true;
+
+	case STATE_FRAME_TIME:
+		if (word != (m_wordIndex++ ? "Time:" : "Frame"))
+			return false;
+		if (m_wordIndex == 2)
+			m_state = STATE_FRAME_TIME_VALUE;
+		return true;
+
+	case STATE_FRAME_TIME_VALUE:
+		frameTime = ParseFloat(word);
+		m_state = STATE_DONE;
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+/*
+	Where frames are decoded to: one row per frame (or cache slot) of rootCount root positions, and one of trackCount tracks
+	in the storage in use (the two other track pointers are null). Rows are independent, so frames can be decoded in any order, from any thread.
+*/
+struct DecodedTracks
+{
+	int			rootCount;
+	int			trackCount;
+	vec3*		rootPositions;
+	Transform*	transforms;
+	vec3*		eulerAngles;
+	quat*		rotations;
+};
+
+/*
+	Lists the axis of each value of a frame line (see SkeletalMotion::SetChannelAxes) from the CHANNELS lines of the joints.
+	Values are read from the frame line in the depth first order of the FlatSkeleton.
+*/
+vector<int> GetFrameChannelAxes(const FlatSkeleton& skeleton, unordered_map<string, vector<int>>& jointChannelsOrderings)
+{
+	vector<int> channelAxes;
+
+	for (int jointIndex = 0; jointIndex < skeleton.GetJointCount(); jointIndex++)
+	{
+		bool bIsRoot = skeleton.parentIndices[jointIndex] < 0;
+		if (!bIsRoot && skeleton.trackIndices[jointIndex] < 0)
+			continue;
+
+		const vector<int>& channelOrdering = jointChannelsOrderings[skeleton.GetJointName(jointIndex)];
+		auto channelAxis = [&](int channel) { return channel < channelOrdering.size() ? channelOrdering[channel] : -1; };
+
+		if (bIsRoot)
+		{
+			// Positions index a vec3 when decoded: an unknown channel keeps its place in the line
+			for (int p = 0; p < 3; p++)
+				channelAxes.push_back(channelAxis(p) < 0 ? p : channelAxis(p));
+		}
+
+		if (skeleton.trackIndices[jointIndex] >= 0)
 		{
-			cout << "Doing nothing for token " << tokens[currentToken] << "\n";
-			currentToken++;
+			for (int r = 0; r < 3; r++)
+				channelAxes.push_back(channelAxis(bIsRoot ? r + 3 : r));
 		}
 	}
-	*endToken = currentToken;
 
-	return new SkeletonJoint(jointName,jointChildren,jointLocalOffset);
+	return channelAxes;
 }
 
 // See BVHImport for explanation
-void ReadFrameRecursive(vector<string>& tokens,
-	unordered_map<string, vector<Transform>>& jointTransforms,
-	SkeletonJoint* joint,
-	int &currentToken,
-	unordered_map<string, vector<int>> &jointsChannelOrderings,
-	bool bIsRoot)
+// Decodes a full line of valueCount values (all skeletons) into row frameSlot of tracks, one entry of the frame layout at a time.
+void ReadFrame(const float* frameValues,
+	int valueCount,
+	int frameSlot,
+	const FlatSkeleton& skeleton,
+	const vector<FrameChannel>& frameLayout,
+	const DecodedTracks& tracks)
 {
-	if (!joint->GetDirectChildren().size())
-		return;
+	vec3* rootPositions = tracks.rootPositions + (size_t)frameSlot * tracks.rootCount;
+	size_t trackRow = (size_t)frameSlot * tracks.trackCount;
 
-	mat3 rotation = mat3(1);
+	// Sines and cosines of the whole line at once (the position values too, there are only three per root).
+	// Quaternions are built from half angles.
+	static thread_local vector<float> sines, cosines;
+	if (!tracks.eulerAngles)
+	{
+		sines.resize(valueCount);
+		cosines.resize(valueCount);
+		ComputeSinCosDegrees(frameValues, valueCount, tracks.rotations ? -0.5f : 1.0f, sines.data(), cosines.data());
+	}
+
+	for (const FrameChannel& channel : frameLayout)
+	{
+		const float* values = frameValues + channel.column;
 
-	for (int r = 0; r < 3; r++)
-		rotation *= GetRotationMatrix(jointsChannelOrderings[joint->GetName()][bIsRoot ? r + 3 : r], atof(tokens[currentToken + r].c_str()));
+		if (channel.kind == FRAME_CHANNEL_POSITION)
+		{
+			vec3 rootPosition;
+			rootPosition[channel.axes[0]] = values[0];
+			rootPosition[channel.axes[1]] = values[1];
+			rootPosition[channel.axes[2]] = values[2];
 
-	Transform jointTransform = Transform(rotation, joint->GetLocalOffset());
+			rootPositions[channel.target] = rootPosition;
+		}
+		else if (tracks.eulerAngles)
+		{
+			tracks.eulerAngles[trackRow + channel.target] = vec3(values[0], values[1], values[2]);
+		}
+		else if (tracks.rotations)
+		{
+			tracks.rotations[trackRow + channel.target] = ComposeEulerQuaternion(channel.order, channel.axes, &sines[channel.column], &cosines[channel.column]);
+		}
+		else
+		{
+			mat3 rotation = ComposeEulerRotation(channel.order, channel.axes, &sines[channel.column], &cosines[channel.column]);
+			tracks.transforms[trackRow + channel.target] = Transform(rotation, skeleton.localOffsets[channel.jointIndex]);
+		}
+	}
+}
 
-	unordered_map<string, vector<Transform>>::const_iterator mapIterator = jointTransforms.find(joint->GetName());
-	if (mapIterator == jointTransforms.end())
+/*
+	Which values of the MOTION block an import keeps (see BVHImportOptions): frame firstFrame + f * frameStride of the file
+	becomes frame f of the motion, and columnRuns lists how many values of a line to skip and to parse, in turns
+	(all of them are parsed when it is empty).
+*/
+struct FrameSelection
+{
+	int			firstFrame;
+	int			frameStride;
+	int			lineValueCount;		// Values on a line of the file
+	vector<int>	columnRuns;
+};
+
+// Skips count values. Returns the position right after the last one, or NULL if the block ends before.
+const char* SkipValues(const char* cursor, const char* end, int count)
+{
+	for (int i = 0; i < count; i++)
 	{
-		jointTransforms[joint->GetName()] = vector<Transform>({ jointTransform });
+		cursor = SkipTokenSeparators(cursor, end);
+		if (cursor == end)
+			return NULL;
+
+		while (cursor < end && !IsTokenSeparator(*cursor))
+			cursor++;
 	}
-	else
+	return cursor;
+}
+
+// Parses the valueCount values of a line that are imported, skipping the others (see FrameSelection). Same result as ParseFloatRow.
+const char* ParseFrameValues(const char* cursor, const char* end, const vector<int>& columnRuns, float* values, int valueCount)
+{
+	if (!columnRuns.size())
+		return ParseFloatRow(cursor, end, values, valueCount);
+
+	for (size_t run = 0; cursor && run < columnRuns.size(); run += 2)
 	{
-		jointTransforms[joint->GetName()].push_back(jointTransform);
+		cursor = SkipValues(cursor, end, columnRuns[run]);
+		if (cursor && columnRuns[run + 1])
+		{
+			cursor = ParseFloatRow(cursor, end, values, columnRuns[run + 1]);
+			values += columnRuns[run + 1];
+		}
 	}
+	return cursor;
+}
 
-	currentToken += 3;
+// Copies the kept joints of a tree into a new one, and deletes the tree. keptJoints is in depth first order, jointIndex is the joint's index.
+SkeletonJoint* PruneJointRecursive(SkeletonJoint* joint, const vector<bool>& keptJoints, int& jointIndex)
+{
+	bool bKept = keptJoints[jointIndex++];
 
+	vector<SkeletonJoint*> keptChildren;
 	for (auto child : joint->GetDirectChildren())
 	{
-		ReadFrameRecursive(tokens, jointTransforms, child, currentToken, jointsChannelOrderings, false);
+		SkeletonJoint* keptChild = PruneJointRecursive(child, keptJoints, jointIndex);
+		if (keptChild)
+			keptChildren.push_back(keptChild);
 	}
+
+	vec3 localOffset = joint->GetLocalOffset();
+	SkeletonJoint* keptJoint = bKept ? new SkeletonJoint(joint->GetName(), keptChildren, localOffset) : NULL;
+	delete joint;
+
+	return keptJoint;
 }
 
 /*
-	BVH Imports:
+	Leaves the joints that are neither in jointNames nor ancestors of one out of skeletalRoots (skeleton is their FlatSkeleton),
+	and their values out of the frame lines: channelAxes becomes the axes of the values kept, selection.columnRuns where they are.
+	Returns false if no joint is kept.
+*/
+bool SelectJoints(const vector<string>& jointNames,
+	const FlatSkeleton& skeleton,
+	vector<SkeletonJoint*>& skeletalRoots,
+	vector<int>& channelAxes,
+	FrameSelection& selection)
+{
+	for (auto& jointName : jointNames)
+	{
+		if (skeleton.FindJoint(jointName) < 0)
+			std::cout << "Could not find joint " << jointName << "\n";
+	}
 
-	1) Opens the file.
-	2) Calls a recursive joint parser to parse the tree structure
-	3) for each frame, calls a recursive frame data reader that recusrively populates 
-		the tree's joints data and advances in the frames data block.
-	4) Profit. Returns a null pointer if there were any issue parsing the data.
+	// Walking backwards, children are done before their parent: a joint is kept if it is listed or has a kept child, and keeps its track if it has one
+	unordered_set<string> keptNames(jointNames.begin(), jointNames.end());
+	vector<bool> keptJoints(skeleton.GetJointCount(), false);
+	vector<bool> keptTracks(skeleton.GetJointCount(), false);
+	for (int jointIndex = skeleton.GetJointCount() - 1; jointIndex >= 0; jointIndex--)
+	{
+		if (keptNames.count(skeleton.GetJointName(jointIndex)))
+			keptJoints[jointIndex] = true;
+
+		int parentIndex = skeleton.parentIndices[jointIndex];
+		if (keptJoints[jointIndex] && parentIndex >= 0)
+			keptJoints[parentIndex] = keptTracks[parentIndex] = true;
+	}
+
+	vector<int> keptAxes;
+	vector<bool> keptColumns(channelAxes.size(), false);
+	for (const FrameChannel& channel : CompileFrameLayout(skeleton, channelAxes))
+	{
+		if (channel.kind == FRAME_CHANNEL_POSITION ? !keptJoints[channel.jointIndex] : !keptTracks[channel.jointIndex])
+			continue;
+
+		keptAxes.insert(keptAxes.end(), channel.axes, channel.axes + 3);
+		fill(keptColumns.begin() + channel.column, keptColumns.begin() + channel.column + 3, true);
+	}
+
+	selection.columnRuns.clear();
+	for (size_t column = 0; column < keptColumns.size();)
+	{
+		int skippedCount = 0, parsedCount = 0;
+		for (; column < keptColumns.size() && !keptColumns[column]; column++)
+			skippedCount++;
+		for (; column < keptColumns.size() && keptColumns[column]; column++)
+			parsedCount++;
+
+		selection.columnRuns.push_back(skippedCount);
+		selection.columnRuns.push_back(parsedCount);
+	}
+
+	int jointIndex = 0;
+	vector<SkeletonJoint*> keptRoots;
+	for (auto root : skeletalRoots)
+	{
+		SkeletonJoint* keptRoot = PruneJointRecursive(root, keptJoints, jointIndex);
+		if (keptRoot)
+			keptRoots.push_back(keptRoot);
+	}
+
+	skeletalRoots = move(keptRoots);
+	channelAxes = move(keptAxes);
+
+	return skeletalRoots.size() > 0;
+}
+
+// Adds the start of every non blank line of [chunkBegin, chunkEnd) to lineStarts. Lines may run past chunkEnd up to end.
+void FindLineStarts(const char* begin, const char* chunkBegin, const char* chunkEnd, const char* end, vector<const char*>& lineStarts)
+{
+	const char* cursor = chunkBegin;
+
+	// A line straddling the chunk start belongs to the previous chunk
+	if (cursor != begin && cursor[-1] != '\n')
+	{
+		cursor = (const char*)memchr(cursor, '\n', chunkEnd - cursor);
+		if (!cursor)
+			return;
+		cursor++;
+	}
+
+	while (cursor < chunkEnd)
+	{
+		const char* lineEnd = (const char*)memchr(cursor, '\n', end - cursor);
+		if (!lineEnd)
+			lineEnd = end;
+
+		if (SkipTokenSeparators(cursor, lineEnd) != lineEnd)
+			lineStarts.push_back(cursor);
+
+		cursor = lineEnd + 1;
+	}
+}
+
+/*
+	Splits the MOTION block in frame lines, scanning threadCount slices of it concurrently.
+	Returns false if the block does not hold exactly one line per frame (values are allowed to wrap lines in BVH files,
+	such files are decoded serially).
 */
-SkeletalMotion* SkeletalMotion::BVHImport(string bvhFilePath)
+bool FindFrameLines(const char* motionData, const char* motionDataEnd, int frameCount, int threadCount, vector<const char*>& frameLines)
 {
-	ifstream bvhFile(bvhFilePath, std::ifstream::binary);
+	size_t motionSize = motionDataEnd - motionData;
+	vector<vector<const char*>> chunkLines(threadCount);
+	vector<thread> workers;
 
-	vector<string> tokens;
-	if (bvhFile.is_open())
+	for (int t = 0; t < threadCount; t++)
 	{
-		// get length of file:
-		bvhFile.seekg(0, bvhFile.end);
-		int length = bvhFile.tellg();
-		bvhFile.seekg(0, bvhFile.beg);
+		const char* chunkBegin = motionData + motionSize * t / threadCount;
+		const char* chunkEnd = motionData + motionSize * (t + 1) / threadCount;
+		workers.push_back(thread(FindLineStarts, motionData, chunkBegin, chunkEnd, motionDataEnd, ref(chunkLines[t])));
+	}
+	for (auto& worker : workers)
+		worker.join();
 
-		char * buffer = new char[length];
+	size_t lineCount = 0;
+	for (auto& lines : chunkLines)
+		lineCount += lines.size();
 
-		// read data as a block:
-		bvhFile.read(buffer, length);
+	if (lineCount != frameCount)
+		return false;
 
-		if (!bvhFile)
-		{
-			bvhFile.close();
+	frameLines.reserve(frameCount + 1);
+	for (auto& lines : chunkLines)
+		frameLines.insert(frameLines.end(), lines.begin(), lines.end());
+	frameLines.push_back(motionDataEnd);
 
-			std::cout << "Could not open " << bvhFilePath << "\n";
-		}
-		bvhFile.close();
+	return true;
+}
 
-		tokenize(tokens, string(buffer));
+/*
+	Decodes frames [frameBegin, frameEnd) of the motion, one per line (see FrameSelection for the frame of the file each one is).
+	frameLines[i] is the start of frame i of the file, frameLines[file frame count] the end of the block.
+	frameChannelCount values of each line are imported. Returns false if a line does not hold exactly selection.lineValueCount values.
+*/
+bool ReadFrameLines(const vector<const char*>& frameLines,
+	int frameBegin,
+	int frameEnd,
+	const FrameSelection& selection,
+	int frameChannelCount,
+	const FlatSkeleton& skeleton,
+	const vector<FrameChannel>& frameLayout,
+	const DecodedTracks& tracks)
+{
+	vector<float> frameValues(frameChannelCount);
 
-		delete[] buffer;
+	for (int frame = frameBegin; frame < frameEnd; frame++)
+	{
+		int fileFrame = selection.firstFrame + frame * selection.frameStride;
+		const char* lineEnd = ParseFrameValues(frameLines[fileFrame], frameLines[fileFrame + 1], selection.columnRuns, frameValues.data(), frameChannelCount);
+		if (!lineEnd || SkipTokenSeparators(lineEnd, frameLines[fileFrame + 1]) != frameLines[fileFrame + 1])
+			return false;
+
+		ReadFrame(frameValues.data(), frameChannelCount, frame, skeleton, frameLayout, tracks);
 	}
 
+	return true;
+}
+
+// Opens a file for reading, saying why when it cannot be read
+bool OpenBVHFile(FileReader& bvhFile, const string& bvhFilePath)
+{
+	if (bvhFile.Open(bvhFilePath))
+		return true;
 
-	if (!tokens.size())
+	if (!FileReader::IsSupported(bvhFile.GetCompression()))
 	{
-		InvalidBVH();
-		return NULL;
+		std::cout << bvhFilePath << " is " << FileReader::GetCompressionName(bvhFile.GetCompression())
+			<< " compressed, which this build cannot read (see file_Reader.h)\n";
 	}
+	else
+	{
+		std::cout << "Could not open " << bvhFilePath << "\n";
+	}
+	return false;
+}
 
-	int currentToken = 0;
-	
-	vector<SkeletonJoint*>		skeletalRoots;
-	vector<vector<vec3>>	rootTrajectories;
-	unordered_map<string, vector<Transform>>	jointTransforms;
+/*
+	BVH Imports:
 
-	unordered_map<string, vector<int>>			jointChannelsOrderings;
-	while (tokens[currentToken] != "MOTION")
+	1) Maps the file (no copy of the data), or parses the caller's buffer where it is.
+		Compressed files are decompressed into memory a buffer at a time instead (see FileReader).
+	2) Parses the HIERARCHY straight from the data in a single pass (see BVHHeaderParser), and compiles the layout
+		of a frame line from the channels.
+	3) for each frame, parses the line of values straight from the data, then runs through the frame layout
+		to fill that frame's row of every track.
+		With several threads, frame lines are located first and contiguous ranges of frames are handed to each thread.
+	4) Profit. Returns a null pointer if there were any issue parsing the data.
+*/
+SkeletalMotion* SkeletalMotion::BVHImport(string bvhFilePath, const BVHImportOptions& options)
+{
+	// The file is mapped rather than read: values are parsed straight from the mapping, which must stay open until parsing is done.
+	// With lazy decoding, the motion keeps the mapping open for as long as it lives, and reads its frames in any order.
+	FileMapping* bvhFile = new FileMapping();
+	if (!bvhFile->Open(bvhFilePath, options.lazyDecoding ? FILE_ACCESS_NORMAL : FILE_ACCESS_SEQUENTIAL))
 	{
+		std::cout << "Could not open " << bvhFilePath << "\n";
+		delete bvhFile;
+		return NULL;
+	}
+
+	FileReader::Compression compression = FileReader::DetectCompression(bvhFile->GetData(), (size_t)bvhFile->GetSize());
+	if (compression != FileReader::COMPRESSION_NONE)
+	{
+		// One byte past the expected size: the read that fills the buffer also finds the end of the file, nothing is reallocated.
+		// The buffer is left uninitialized, the reader writes every byte of the text.
+		size_t bufferSize = FileReader::GetTextSizeHint(compression, bvhFile->GetData(), (size_t)bvhFile->GetSize()) + 1;
+		unique_ptr<char[]> bvhText(new char[bufferSize]);
+		size_t textSize = 0;
+		delete bvhFile;
+
+		FileReader bvhReader;
+		if (!OpenBVHFile(bvhReader, bvhFilePath))
+			return NULL;
 
-		if (!currentToken && tokens[currentToken].compare("HIERARCHY"))
+		// Reads into whatever room the buffer has, and only grows it once it is full
+		while (true)
 		{
-			InvalidBVH();
+			if (textSize == bufferSize)
+			{
+				bufferSize = std::max(bufferSize * 2, (size_t)1 << 20);
+				unique_ptr<char[]> grownText(new char[bufferSize]);
+				memcpy(grownText.get(), bvhText.get(), textSize);
+				bvhText = std::move(grownText);
+			}
+
+			size_t roomSize = bufferSize - textSize;
+			size_t readSize = bvhReader.Read(bvhText.get() + textSize, roomSize);
+			textSize += readSize;
+			if (readSize < roomSize)
+				break;
+		}
+		if (bvhReader.Failed())
+		{
+			std::cout << "Could not decompress " << bvhFilePath << "\n";
 			return NULL;
 		}
 
-		if (!tokens[currentToken].compare("ROOT"))
-		{
-			vector<int> rootOrdering;
-			int endToken = -1;
-			SkeletonJoint* rootJoint = ParseJoint(tokens, currentToken, &endToken, jointChannelsOrderings);
+		return BVHImportData(bvhFilePath, bvhText.get(), textSize, options, NULL);
+	}
 
-			if (rootJoint)
-				skeletalRoots.push_back(rootJoint);
+	return BVHImportData(bvhFilePath, bvhFile->GetData(), (size_t)bvhFile->GetSize(), options, bvhFile);
+}
 
-			currentToken = endToken;
-		}
+SkeletalMotion* SkeletalMotion::BVHImport(const char* bvhData, size_t bvhDataSize, const BVHImportOptions& options)
+{
+	return BVHImportData("BVH buffer", bvhData, bvhDataSize, options, NULL);
+}
 
-		currentToken++;
+SkeletalMotion* SkeletalMotion::BVHImport(istream& bvhStream, const BVHImportOptions& options)
+{
+	// Read in one go when the stream knows its size, chunk by chunk otherwise (pipes, sockets...)
+	vector<char> buffer;
+	streampos streamBegin = bvhStream.tellg();
+	if (streamBegin != streampos(-1) && bvhStream.seekg(0, ios::end))
+	{
+		buffer.resize((size_t)(bvhStream.tellg() - streamBegin));
+		bvhStream.seekg(streamBegin);
+		bvhStream.read(buffer.data(), buffer.size());
+		buffer.resize((size_t)bvhStream.gcount());
 	}
+	else
+	{
+		bvhStream.clear();
 
-	// Print the Skeleton to the console
-	std::cout << "Loaded the following Skeleton: \n\n";
-	for (auto roots : skeletalRoots)
+		size_t chunkSize = 1 << 20;
+		while (bvhStream)
+		{
+			size_t bufferSize = buffer.size();
+			buffer.resize(bufferSize + chunkSize);
+			bvhStream.read(buffer.data() + bufferSize, chunkSize);
+			buffer.resize(bufferSize + (size_t)bvhStream.gcount());
+		}
+	}
+
+	return BVHImportData("BVH stream", buffer.data(), buffer.size(), options, NULL);
+}
+
+SkeletalMotion* SkeletalMotion::BVHImportData(string bvhName, const char* bvhData, size_t bvhDataSize, const BVHImportOptions& options, FileMapping* mappedFile)
+{
+	unique_ptr<FileMapping> bvhFile(mappedFile);
+	const char* bvhDataEnd = bvhData + bvhDataSize;
+
+	bool bPartialImport = options.jointNames.size() || options.frameBegin > 0 || options.frameEnd >= 0 || options.frameStride > 1;
+	bool useBinaryCache = options.useBinaryCache && !bPartialImport && bvhFile;
+
+	string cachePath = bvhName + ".cbvh";
+	uint64_t contentHash = 0;
+	if (useBinaryCache)
 	{
-		roots->PrintJoint();
+		contentHash = HashBVHContent(bvhData, bvhDataSize);
+
+		SkeletalMotion* cachedMotion = CBVHImport(cachePath, contentHash);
+		if (cachedMotion)
+		{
+			cachedMotion->m_name = bvhName;
+			return cachedMotion;
+		}
 	}
 
-	if (tokens[currentToken + 1].compare("Frames:") || tokens[currentToken + 3].compare("Frame") | tokens[currentToken + 4].compare("Time:"))
+	BVHHeaderParser header;
+	if (header.Parse(bvhData, bvhDataSize, true) != BVHHeaderParser::PARSED)
 		INVALID_BVH
 
-	int frameCount = atoi(tokens[currentToken + 2].c_str());
-	float frameTime = atof(tokens[currentToken + 5].c_str());
+	const char* motionData = bvhData + header.motionOffset;
+	vector<SkeletonJoint*>& skeletalRoots = header.skeletalRoots;
 
-	currentToken += 6;
+	FlatSkeleton skeleton(skeletalRoots);
+	vector<int> channelAxes = GetFrameChannelAxes(skeleton, header.jointChannelsOrderings);
 
-	for (int frame = 0; frame < frameCount; frame++)
+	// Projection: the joints and frames asked for, the values of the others are skipped
+	FrameSelection selection;
+	selection.lineValueCount = (int)channelAxes.size();
+	if (options.jointNames.size())
 	{
-		vector<vec3> rootPositions;
-		for (int rootIndex = 0; rootIndex < skeletalRoots.size(); rootIndex++)
+		if (!SelectJoints(options.jointNames, skeleton, skeletalRoots, channelAxes, selection))
 		{
-			SkeletonJoint* root = skeletalRoots[rootIndex];
+			std::cout << "None of the joints to import are in " << bvhName << "\n";
+			return NULL;
+		}
+		skeleton = FlatSkeleton(skeletalRoots);
+	}
 
-			vec3 rootPosition;
-			rootPosition[jointChannelsOrderings[root->GetName()][0]] = atof(tokens[currentToken + 0].c_str());
-			rootPosition[jointChannelsOrderings[root->GetName()][1]] = atof(tokens[currentToken + 1].c_str());
-			rootPosition[jointChannelsOrderings[root->GetName()][2]] = atof(tokens[currentToken + 2].c_str());
+	PrintSkeletons(skeletalRoots);
+
+	int fileFrameCount = header.frameCount;
+	int fileFrameEnd = options.frameEnd < 0 ? fileFrameCount : std::min(options.frameEnd, fileFrameCount);
+	selection.firstFrame = std::min(std::max(options.frameBegin, 0), fileFrameEnd);
+	selection.frameStride = std::max(options.frameStride, 1);
+	bool bSelectedFrames = selection.firstFrame > 0 || selection.frameStride > 1 || fileFrameEnd < fileFrameCount;
 
-			rootPositions.push_back(rootPosition);
+	int frameCount = (fileFrameEnd - selection.firstFrame + selection.frameStride - 1) / selection.frameStride;
+	float frameTime = header.frameTime * selection.frameStride;
 
-			currentToken += 3;
+	vector<FrameChannel> frameLayout = CompileFrameLayout(skeleton, channelAxes);
+	int frameChannelCount = (int)channelAxes.size();
+
+	vector<vec3>		rootTrajectories;
+	vector<Transform>	frameTransforms;
+	vector<vec3>		frameEulerAngles;
+	vector<quat>		frameRotations;
+	DecodedTracks		tracks;
+
+	// Sizes the root trajectories and the tracks of the requested storage for frameCount frames (or cache slots)
+	auto allocateTracks = [&](int trackFrameCount)
+	{
+		size_t trackSlotCount = (size_t)trackFrameCount * skeleton.GetTrackCount();
+		rootTrajectories.assign((size_t)trackFrameCount * skeletalRoots.size(), vec3());
 
-			ReadFrameRecursive(tokens, jointTransforms, root, currentToken, jointChannelsOrderings, true);
+		tracks.rootCount = (int)skeletalRoots.size();
+		tracks.trackCount = skeleton.GetTrackCount();
+		tracks.rootPositions = rootTrajectories.data();
+		tracks.transforms = NULL;
+		tracks.eulerAngles = NULL;
+		tracks.rotations = NULL;
+
+		if (options.storage == MOTION_STORAGE_EULER_ANGLES)
+		{
+			frameEulerAngles.assign(trackSlotCount, vec3());
+			tracks.eulerAngles = frameEulerAngles.data();
 		}
-		rootTrajectories.push_back(rootPositions);
+		else if (options.storage == MOTION_STORAGE_QUATERNIONS)
+		{
+			frameRotations.assign(trackSlotCount, quat());
+			tracks.rotations = frameRotations.data();
+		}
+		else
+		{
+			frameTransforms.assign(trackSlotCount, Transform());
+			tracks.transforms = frameTransforms.data();
+		}
+	};
+
+	// Hands the decoded storage over to a new motion
+	auto createMotion = [&]()
+	{
+		SkeletalMotion* motion = new SkeletalMotion(bvhName, move(rootTrajectories), move(frameTransforms), skeletalRoots, 1.0 / frameTime, frameCount);
+		skeletalRoots.clear();
+		motion->m_storage = options.storage;
+		motion->m_frameEulerAngles = move(frameEulerAngles);
+		motion->m_frameRotations = move(frameRotations);
+		motion->m_memoizeRotations = options.memoizeRotations;
+		motion->SetChannelAxes(move(channelAxes));
+		return motion;
+	};
+
+	int threadCount = options.threadCount > 0 ? options.threadCount : (int)thread::hardware_concurrency();
+	threadCount = std::max(1, std::min(threadCount, frameCount));
+
+	vector<const char*> frameLines;
+	if (options.lazyDecoding && bvhFile && !useBinaryCache && frameCount && FindFrameLines(motionData, bvhDataEnd, fileFrameCount, threadCount, frameLines))
+	{
+		// Lazy decoding: only the frame lines are indexed now, the tracks hold the cached frames (see ResolveFrame)
+		int cacheSize = std::max(1, std::min(options.lazyCacheSize, frameCount));
+		allocateTracks(cacheSize);
+
+		SkeletalMotion* result = createMotion();
+
+		result->m_frameOffsets.reserve(frameCount);
+		for (int frame = 0; frame < frameCount; frame++)
+			result->m_frameOffsets.push_back(frameLines[selection.firstFrame + frame * selection.frameStride] - bvhData);
+
+		result->m_frameValues.resize(frameChannelCount);
+		result->m_columnRuns = selection.columnRuns;
+		result->m_cachedFrames.assign(cacheSize, -1);
+		result->m_cachedFramesLastUse.assign(cacheSize, 0);
+		result->m_mappedFile = bvhFile.release();
+
+		return result;
+	}
+
+	allocateTracks(frameCount);
+
+	// Lines are also indexed to go straight to the frames asked for
+	if ((threadCount > 1 || bSelectedFrames) && FindFrameLines(motionData, bvhDataEnd, fileFrameCount, threadCount, frameLines))
+	{
+		atomic<bool> validFrames(true);
+		vector<thread> workers;
+
+		for (int t = 0; t < threadCount; t++)
+		{
+			int frameBegin = (int)((int64_t)frameCount * t / threadCount);
+			int frameEnd = (int)((int64_t)frameCount * (t + 1) / threadCount);
+
+			workers.push_back(thread([&, frameBegin, frameEnd]()
+			{
+				if (!ReadFrameLines(frameLines, frameBegin, frameEnd, selection, frameChannelCount, skeleton, frameLayout, tracks))
+					validFrames = false;
+			}));
+		}
+		for (auto& worker : workers)
+			worker.join();
+
+		if (!validFrames)
+			INVALID_BVH
+	}
+	else
+	{
+		vector<float> frameValues(frameChannelCount);
+		int frame = 0;
+
+		for (int fileFrame = 0; fileFrame < fileFrameEnd; fileFrame++)
+		{
+			if (fileFrame < selection.firstFrame || (fileFrame - selection.firstFrame) % selection.frameStride)
+			{
+				motionData = SkipValues(motionData, bvhDataEnd, selection.lineValueCount);
+				if (!motionData)
+					INVALID_BVH
+				continue;
+			}
+
+			motionData = ParseFrameValues(motionData, bvhDataEnd, selection.columnRuns, frameValues.data(), frameChannelCount);
+			if (!motionData)
+				INVALID_BVH
+
+			ReadFrame(frameValues.data(), frameChannelCount, frame++, skeleton, frameLayout, tracks);
+		}
+		if (fileFrameEnd == fileFrameCount && SkipTokenSeparators(motionData, bvhDataEnd) != bvhDataEnd)
+			INVALID_BVH
 	}
-	if (currentToken != tokens.size())
-		INVALID_BVH
 
-	SkeletalMotion* result = new SkeletalMotion(bvhFilePath, rootTrajectories, jointTransforms, skeletalRoots, 1.0 / frameTime, frameCount);
+	SkeletalMotion* result = createMotion();
+
+	// A cache that cannot be written is not an import error, the next import will just parse the file again
+	if (useBinaryCache)
+		result->CBVHExport(cachePath, contentHash);
 	
 	/*if (bNormalizedOffsets)
 	{
@@ -344,47 +982,306 @@ SkeletalMotion* SkeletalMotion::BVHImport(string bvhFilePath)
 	return result;
 }
 
-// Gets Which rotation matrix we should output for each axis
-mat3 GetRotationMatrix(int axis, float angle)
+/*
+	Lazy decoding:
+	The tracks of a lazily decoded motion are a small cache: each slot holds one decoded frame.
+	Returns the slot frameIndex lives in, decoding it from the mapped file over the least recently used slot if needed.
+*/
+int SkeletalMotion::ResolveFrame(int frameIndex)
 {
-	angle *= M_PI / 180.0;
+	if (!m_cachedFrames.size())
+		return frameIndex;
 
-	if (axis == 0)
+	int slot = 0;
+	for (int i = 0; i < m_cachedFrames.size(); i++)
 	{
-		return mat3
-			(
-			1, 0, 0,
-			0, cos(angle), -sin(angle),
-			0, sin(angle), cos(angle)
-			);
+		if (m_cachedFrames[i] == frameIndex)
+		{
+			m_cachedFramesLastUse[i] = ++m_cacheClock;
+			return i;
+		}
+
+		if (m_cachedFramesLastUse[i] < m_cachedFramesLastUse[slot])
+			slot = i;
 	}
-	else if (axis == 1)
+
+	const char* fileEnd = m_mappedFile->GetData() + m_mappedFile->GetSize();
+	const char* lineBegin = m_mappedFile->GetData() + m_frameOffsets[frameIndex];
+	const char* lineEnd = (const char*)memchr(lineBegin, '\n', fileEnd - lineBegin);
+	if (!lineEnd)
+		lineEnd = fileEnd;
+
+	const char* rowEnd = ParseFrameValues(lineBegin, lineEnd, m_columnRuns, m_frameValues.data(), (int)m_frameValues.size());
+	if (!rowEnd || SkipTokenSeparators(rowEnd, lineEnd) != lineEnd)
 	{
-		return mat3
-			(
-			cos(angle), 0, sin(angle),
-			0, 1, 0,
-			-sin(angle), 0, cos(angle)
-			);
+		// Too late to fail the import, fall back to the rest pose
+		std::cout << "There were invalid values encountered in frame " << frameIndex << " of your BVH file.\n";
+		fill(m_frameValues.begin(), m_frameValues.end(), 0.0f);
 	}
-	else if (axis == 2)
+
+	// The rotations memoized for this slot belong to the frame being evicted
+	for (auto& memoizedSlot : m_memoizedSlots)
 	{
-		return mat3
-			(
-			cos(angle), -sin(angle), 0,
-			sin(angle), cos(angle), 0,
-			-0, 0, 1
-			);
+		if (memoizedSlot == slot)
+			memoizedSlot = -1;
 	}
-	else
+
+	DecodedTracks tracks;
+	tracks.rootCount = (int)m_skeletonRoots.size();
+	tracks.trackCount = m_flatSkeleton.GetTrackCount();
+	tracks.rootPositions = m_rootTrajectories.data();
+	tracks.transforms = m_storage == MOTION_STORAGE_TRANSFORMS ? m_frameTransforms.data() : NULL;
+	tracks.eulerAngles = m_storage == MOTION_STORAGE_EULER_ANGLES ? m_frameEulerAngles.data() : NULL;
+	tracks.rotations = m_storage == MOTION_STORAGE_QUATERNIONS ? m_frameRotations.data() : NULL;
+
+	ReadFrame(m_frameValues.data(), (int)m_frameValues.size(), slot, m_flatSkeleton, m_frameLayout, tracks);
+
+	m_cachedFrames[slot] = frameIndex;
+	m_cachedFramesLastUse[slot] = ++m_cacheClock;
+
+	return slot;
+}
+
+// Number of values in [cursor, end), used to tell a row cut by the end of a chunk from a malformed one.
+int CountValues(const char* cursor, const char* end)
+{
+	int valueCount = 0;
+	while ((cursor = SkipTokenSeparators(cursor, end)) < end)
+	{
+		valueCount++;
+		while (cursor < end && !IsTokenSeparator(*cursor))
+			cursor++;
+	}
+	return valueCount;
+}
+
+/*
+	BVH Stream Imports:
+
+	Same as BVHImport, except that the file is read (and decompressed, see FileReader) through a fixed size buffer instead of being mapped:
+	1) chunks are appended to the buffer until the whole HIERARCHY and MOTION header is in it.
+	2) rows are parsed from the part of the buffer that ends on a separator, so no value is ever cut in two.
+	3) whatever is left (a partial line) is moved to the front of the buffer and the next chunk is read after it.
+	Offsets are 64 bits wide, and the buffer never grows past a chunk plus one frame line.
+*/
+SkeletalMotion* SkeletalMotion::BVHStreamImport(string bvhFilePath, const BVHFrameSink& frameSink, size_t chunkSize)
+{
+	FileReader bvhFile;
+	if (!OpenBVHFile(bvhFile, bvhFilePath))
+		return NULL;
+
+	chunkSize = std::max(chunkSize, (size_t)4096);
+
+	// Reads the next chunk after the bufferSize bytes already in the buffer. Returns the number of bytes read.
+	vector<char> buffer;
+	size_t bufferSize = 0;
+	uint64_t fileOffset = 0;
+	auto readChunk = [&]() -> size_t
+	{
+		if (buffer.size() < bufferSize + chunkSize)
+			buffer.resize(bufferSize + chunkSize);
+
+		size_t readSize = bvhFile.Read(buffer.data() + bufferSize, chunkSize);
+
+		bufferSize += readSize;
+		fileOffset += readSize;
+		return readSize;
+	};
+
+	// 1) The header is parsed as chunks come in (it stays at the front of the buffer), until the frame time shows up.
+	BVHHeaderParser header;
+	BVHHeaderParser::Result headerResult = BVHHeaderParser::INCOMPLETE;
+	bool endOfFile = false;
+	while (headerResult == BVHHeaderParser::INCOMPLETE)
+	{
+		endOfFile = !readChunk();
+		headerResult = header.Parse(buffer.data(), bufferSize, endOfFile);
+
+		// A header this large means there is no MOTION block to be found
+		if (headerResult == BVHHeaderParser::INCOMPLETE && bufferSize > 64 * chunkSize)
+			INVALID_BVH
+	}
+	if (headerResult != BVHHeaderParser::PARSED)
+		INVALID_BVH
+
+	PrintSkeletons(header.skeletalRoots);
+
+	size_t motionOffset = header.motionOffset;
+	vector<SkeletonJoint*>& skeletalRoots = header.skeletalRoots;
+	int frameCount = header.frameCount;
+	float frameTime = header.frameTime;
+
+	FlatSkeleton skeleton(skeletalRoots);
+	vector<int> channelAxes = GetFrameChannelAxes(skeleton, header.jointChannelsOrderings);
+	vector<FrameChannel> frameLayout = CompileFrameLayout(skeleton, channelAxes);
+	int frameChannelCount = (int)channelAxes.size();
+
+	// Frames are either stored in their slot of the motion, or decoded into slot 0 of single frame tracks and handed to the sink.
+	int storedFrameCount = frameSink ? 1 : frameCount;
+	vector<vec3> rootTrajectories((size_t)storedFrameCount * skeletalRoots.size());
+	vector<Transform> frameTransforms((size_t)storedFrameCount * skeleton.GetTrackCount());
+
+	DecodedTracks tracks;
+	tracks.rootCount = (int)skeletalRoots.size();
+	tracks.trackCount = skeleton.GetTrackCount();
+	tracks.rootPositions = rootTrajectories.data();
+	tracks.transforms = frameTransforms.data();
+	tracks.eulerAngles = NULL;
+	tracks.rotations = NULL;
+
+	// The sink sees the transforms by name: each track is copied to its entry, found once here
+	unordered_map<string, Transform> sinkTransforms;
+	vector<Transform*> sinkTrackTransforms;
+	if (frameSink)
+	{
+		for (int trackIndex = 0; trackIndex < skeleton.GetTrackCount(); trackIndex++)
+			sinkTrackTransforms.push_back(&sinkTransforms[skeleton.GetJointName(skeleton.trackJoints[trackIndex])]);
+	}
+
+	vector<float> frameValues(frameChannelCount);
+	int frame = 0;
+	size_t cursor = motionOffset;
+
+	while (frame < frameCount)
+	{
+		// Values are only parsed up to the last separator: past it, a value may continue in the next chunk.
+		size_t parseEnd = bufferSize;
+		if (!endOfFile)
+		{
+			while (parseEnd > cursor && !IsTokenSeparator(buffer[parseEnd - 1]))
+				parseEnd--;
+		}
+
+		const char* data = buffer.data();
+		while (frame < frameCount)
+		{
+			const char* rowEnd = ParseFloatRow(data + cursor, data + parseEnd, frameValues.data(), frameChannelCount);
+			if (!rowEnd)
+			{
+				if (endOfFile || CountValues(data + cursor, data + parseEnd) >= frameChannelCount)
+				{
+					std::cout << "Invalid frame " << frame << " after byte " << fileOffset - (bufferSize - cursor) << "\n";
+					INVALID_BVH
+				}
+				break;
+			}
+			cursor = rowEnd - data;
+
+			if (frameSink)
+			{
+				ReadFrame(frameValues.data(), frameChannelCount, 0, skeleton, frameLayout, tracks);
+				for (int trackIndex = 0; trackIndex < tracks.trackCount; trackIndex++)
+					*sinkTrackTransforms[trackIndex] = frameTransforms[trackIndex];
+
+				// The sink asked to stop: no more frames are wanted
+				if (!frameSink(frame, rootTrajectories, sinkTransforms))
+				{
+					frameCount = frame;
+					break;
+				}
+			}
+			else
+			{
+				ReadFrame(frameValues.data(), frameChannelCount, frame, skeleton, frameLayout, tracks);
+			}
+			frame++;
+		}
+
+		if (frame == frameCount)
+			break;
+
+		if (endOfFile)
+			INVALID_BVH
+
+		// 3) Carry the partial row over and refill the buffer behind it
+		bufferSize -= cursor;
+		memmove(buffer.data(), buffer.data() + cursor, bufferSize);
+		cursor = 0;
+		endOfFile = !readChunk();
+	}
+
+	if (!frameSink)
+	{
+		// Trailing values are an error, like in BVHImport
+		while (true)
+		{
+			if (SkipTokenSeparators(buffer.data() + cursor, buffer.data() + bufferSize) != buffer.data() + bufferSize)
+				INVALID_BVH
+
+			bufferSize = 0;
+			cursor = 0;
+			if (!readChunk())
+				break;
+		}
+
+		// All the frames were there, but the compressed data after them is not right
+		if (bvhFile.Failed())
+			INVALID_BVH
+	}
+
+	if (frameSink)
 	{
-		std::cout << "Warning: Invalid rotation axis provided in bvh file...\n";
-		return mat3(1.0f);
+		// Frames went to the sink, the motion only carries the skeleton
+		rootTrajectories.clear();
+		frameTransforms.clear();
+		frameCount = 0;
 	}
+
+	SkeletalMotion* result = new SkeletalMotion(bvhFilePath, move(rootTrajectories), move(frameTransforms), skeletalRoots, 1.0 / frameTime, frameCount);
+	result->SetChannelAxes(move(channelAxes));
+	skeletalRoots.clear();
+
+	return result;
+}
+
+/*
+	BVH Probes:
+
+	Reads the file a chunk at a time, the first chunk being large enough for most headers, and feeds the header parser
+	until it is done. The skeleton and the frame layout are built as for an import, then the SkeletonJoint trees are deleted.
+*/
+bool SkeletalMotion::ProbeBVH(string bvhFilePath, BVHInfo* info)
+{
+	FileReader bvhFile;
+	if (!bvhFile.Open(bvhFilePath))
+		return false;
+
+	vector<char> buffer;
+	size_t chunkSize = 16 << 10;
+	BVHHeaderParser header;
+	header.verbose = false;
+	BVHHeaderParser::Result headerResult = BVHHeaderParser::INCOMPLETE;
+	while (headerResult == BVHHeaderParser::INCOMPLETE)
+	{
+		size_t bufferSize = buffer.size();
+		buffer.resize(bufferSize + chunkSize);
+		size_t readSize = bvhFile.Read(buffer.data() + bufferSize, chunkSize);
+		buffer.resize(bufferSize + readSize);
+
+		headerResult = header.Parse(buffer.data(), buffer.size(), !readSize);
+		chunkSize *= 2;
+	}
+	if (headerResult != BVHHeaderParser::PARSED)
+		return false;
+
+	FlatSkeleton skeleton(header.skeletalRoots);
+	vector<int> channelAxes = GetFrameChannelAxes(skeleton, header.jointChannelsOrderings);
+
+	info->frameLayout = CompileFrameLayout(skeleton, channelAxes);
+	info->frameChannelCount = (int)channelAxes.size();
+	info->frameCount = header.frameCount;
+	info->samplingRate = 1.0 / header.frameTime;
+	info->motionOffset = header.motionOffset;
+
+	// The joints go with the parser
+	skeleton.joints.clear();
+	info->skeleton = move(skeleton);
+
+	return true;
 }
 
 // Helper that turns a bunch of string parameters from a bvh to int values
-int ChannelOrderToInt(string str)
+int ChannelOrderToInt(string_view str)
 {
 	if (!str.compare("Xrotation"))
 	{
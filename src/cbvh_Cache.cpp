@@ -0,0 +1,330 @@
+/*
+	CBVH++: Loads a skeletal animation
+	Copyright(C) 2017 Vincent Petrella
+
+	This program is free software : you can redistribute it and / or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include <fstream>
+#include <iostream>
+#include <cstdio>
+#include <algorithm>
+#include <string.h>
+#include <atomic>
+#include "animation.h"
+#include "file_Mapping.h"
+
+#ifdef _WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
+// Frees a joint tree, see bvh_Importer.cpp
+void DeleteJointRecursive(SkeletonJoint* joint);
+
+/*
+	.cbvh binary cache:
+
+	A flattened copy of a SkeletalMotion laid out so that the mapped file can be used in place: the motion's tracks point
+	straight into the mapping. All arrays start on a 64 byte boundary. Values are stored in the native byte order;
+	caches are meant to live next to the BVH they were built from, on the machine that reads them.
+*/
+
+#define CBVH_VERSION 3
+#define CBVH_ALIGNMENT 64
+
+struct CBVHHeader
+{
+	char		magic[4];				// "CBVH"
+	uint32_t	version;
+	uint64_t	sourceHash;				// Content hash of the BVH file the cache was built from, 0 if unknown
+	uint64_t	fileSize;
+	uint32_t	transformSize;			// sizeof(Transform) of the build that wrote the file
+	uint32_t	rootCount;
+	uint32_t	jointCount;				// End sites included
+	uint32_t	trackCount;				// Joints with a transform track (all but end sites), see FlatSkeleton
+	uint32_t	frameCount;
+	float		samplingRate;
+	uint64_t	jointsOffset;			// CBVHJoint[jointCount], depth first, one root after the other
+	uint64_t	namesOffset;			// char[namesSize], joint names back to back
+	uint64_t	namesSize;
+	uint64_t	rootPositionsOffset;	// vec3[frameCount * rootCount]
+	uint64_t	tracksOffset;			// Transform[frameCount][trackCount]
+};
+
+struct CBVHJoint
+{
+	int32_t		parentIndex;			// -1 for roots
+	int32_t		trackIndex;				// -1 for end sites
+	uint32_t	nameOffset;
+	uint32_t	nameLength;
+	float		localOffset[3];
+	int32_t		channelCount;
+	int32_t		channels[6];			// Axes of the values of the joint on a frame line (see SkeletalMotion::SetChannelAxes)
+};
+
+/*
+	Content hash of a BVH file, used to tell whether a cache is still up to date.
+	Reads 32 bytes per step over four independent lanes: this only needs to be a lot faster than parsing the file.
+*/
+uint64_t HashBVHContent(const char* data, uint64_t size)
+{
+	const uint64_t prime = 0x9E3779B97F4A7C15ull;
+	uint64_t lanes[4] = { size, size ^ prime, size + prime, ~size };
+
+	uint64_t offset = 0;
+	for (; offset + 32 <= size; offset += 32)
+	{
+		for (int lane = 0; lane < 4; lane++)
+		{
+			uint64_t word;
+			memcpy(&word, data + offset + lane * 8, 8);
+			lanes[lane] = (lanes[lane] ^ word) * prime;
+			lanes[lane] ^= lanes[lane] >> 31;
+		}
+	}
+
+	uint64_t hash = lanes[0] ^ (lanes[1] * 3) ^ (lanes[2] * 5) ^ (lanes[3] * 7);
+	for (; offset < size; offset++)
+		hash = (hash ^ (uint8_t)data[offset]) * prime;
+
+	hash ^= hash >> 33;
+	hash *= 0xFF51AFD7ED558CCDull;
+	hash ^= hash >> 33;
+
+	return hash;
+}
+
+inline uint64_t AlignCBVHOffset(uint64_t offset)
+{
+	return (offset + CBVH_ALIGNMENT - 1) & ~(uint64_t)(CBVH_ALIGNMENT - 1);
+}
+
+bool SkeletalMotion::CBVHExport(string cbvhFilePath, uint64_t sourceHash)
+{
+	if (m_cachedFrames.size())
+	{
+		std::cout << "Lazily decoded motions cannot be written to a binary cache, import " << m_name << " without lazyDecoding first.\n";
+		return false;
+	}
+
+	// The joints are written in the order of the flat skeleton, with the values of each on a frame line
+	const FlatSkeleton& skeleton = m_flatSkeleton;
+	vector<CBVHJoint> joints(skeleton.GetJointCount());
+	string names;
+	int channel = 0;
+	for (int jointIndex = 0; jointIndex < skeleton.GetJointCount(); jointIndex++)
+	{
+		CBVHJoint& flatJoint = joints[jointIndex];
+		memset(&flatJoint, 0, sizeof(flatJoint));
+
+		const string& jointName = skeleton.GetJointName(jointIndex);
+		flatJoint.parentIndex = skeleton.parentIndices[jointIndex];
+		flatJoint.trackIndex = skeleton.trackIndices[jointIndex];
+		flatJoint.nameOffset = (uint32_t)names.size();
+		flatJoint.nameLength = (uint32_t)jointName.size();
+		names += jointName;
+
+		vec3 localOffset = skeleton.localOffsets[jointIndex];
+		flatJoint.localOffset[0] = localOffset.x;
+		flatJoint.localOffset[1] = localOffset.y;
+		flatJoint.localOffset[2] = localOffset.z;
+
+		flatJoint.channelCount = (flatJoint.parentIndex < 0 ? 3 : 0) + (flatJoint.trackIndex >= 0 ? 3 : 0);
+		for (int c = 0; c < flatJoint.channelCount && channel < m_channelAxes.size(); c++)
+			flatJoint.channels[c] = m_channelAxes[channel++];
+	}
+
+	CBVHHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, "CBVH", 4);
+	header.version = CBVH_VERSION;
+	header.sourceHash = sourceHash;
+	header.transformSize = sizeof(Transform);
+	header.rootCount = (uint32_t)m_skeletonRoots.size();
+	header.jointCount = (uint32_t)joints.size();
+	header.trackCount = (uint32_t)skeleton.GetTrackCount();
+	header.frameCount = (uint32_t)m_frameCount;
+	header.samplingRate = m_samplingRate;
+
+	header.jointsOffset = AlignCBVHOffset(sizeof(CBVHHeader));
+	header.namesOffset = AlignCBVHOffset(header.jointsOffset + joints.size() * sizeof(CBVHJoint));
+	header.namesSize = names.size();
+	header.rootPositionsOffset = AlignCBVHOffset(header.namesOffset + header.namesSize);
+	header.tracksOffset = AlignCBVHOffset(header.rootPositionsOffset + (uint64_t)m_frameCount * m_skeletonRoots.size() * sizeof(vec3));
+	header.fileSize = header.tracksOffset + (uint64_t)m_frameCount * skeleton.GetTrackCount() * sizeof(Transform);
+
+	// Written aside and moved in place once complete, so that a reader never maps a half written cache.
+	// The name is unique to this write: processes or threads caching the same clip at once each rename a whole file.
+	static atomic<uint32_t> temporaryFileCount(0);
+	string temporaryPath = cbvhFilePath + "." + to_string(getpid()) + "." + to_string(temporaryFileCount++) + ".tmp";
+	ofstream cbvhFile(temporaryPath, std::ofstream::binary | std::ofstream::trunc);
+	if (!cbvhFile.is_open())
+	{
+		std::cout << "Could not write " << cbvhFilePath << "\n";
+		return false;
+	}
+
+	uint64_t written = 0;
+	auto writeAt = [&](uint64_t offset, const void* data, uint64_t size)
+	{
+		static const char padding[CBVH_ALIGNMENT] = {};
+		cbvhFile.write(padding, offset - written);
+		cbvhFile.write((const char*)data, size);
+		written = offset + size;
+	};
+
+	writeAt(0, &header, sizeof(header));
+	writeAt(header.jointsOffset, joints.data(), joints.size() * sizeof(CBVHJoint));
+	writeAt(header.namesOffset, names.data(), names.size());
+	writeAt(header.rootPositionsOffset, m_rootPositions, (uint64_t)m_frameCount * m_skeletonRoots.size() * sizeof(vec3));
+	if (m_storage == MOTION_STORAGE_TRANSFORMS)
+	{
+		writeAt(header.tracksOffset, m_transformFrames, (uint64_t)m_frameCount * skeleton.GetTrackCount() * sizeof(Transform));
+	}
+	else
+	{
+		// Caches always hold transforms: other storages build them first, a frame at a time
+		vector<Transform> frameTransforms(skeleton.GetTrackCount());
+		for (int frame = 0; frame < m_frameCount; frame++)
+		{
+			for (int trackIndex = 0; trackIndex < skeleton.GetTrackCount(); trackIndex++)
+				frameTransforms[trackIndex] = GetLocalTransform(trackIndex, frame);
+
+			writeAt(header.tracksOffset + (uint64_t)frame * skeleton.GetTrackCount() * sizeof(Transform), frameTransforms.data(), frameTransforms.size() * sizeof(Transform));
+		}
+	}
+
+	cbvhFile.close();
+	if (!cbvhFile)
+	{
+		std::cout << "Could not write " << cbvhFilePath << "\n";
+		remove(temporaryPath.c_str());
+		return false;
+	}
+
+	remove(cbvhFilePath.c_str());
+	if (rename(temporaryPath.c_str(), cbvhFilePath.c_str()))
+	{
+		std::cout << "Could not write " << cbvhFilePath << "\n";
+		remove(temporaryPath.c_str());
+		return false;
+	}
+
+	return true;
+}
+
+SkeletalMotion* SkeletalMotion::CBVHImport(string cbvhFilePath, uint64_t expectedSourceHash)
+{
+	// The mapping becomes the storage of the motion, which reads frames in whatever order they are queried
+	FileMapping* cbvhFile = new FileMapping();
+	if (!cbvhFile->Open(cbvhFilePath, FILE_ACCESS_NORMAL) || cbvhFile->GetSize() < sizeof(CBVHHeader))
+	{
+		delete cbvhFile;
+		return NULL;
+	}
+
+	const char* data = cbvhFile->GetData();
+	const CBVHHeader* header = (const CBVHHeader*)data;
+
+	// Anything unexpected simply means the cache cannot be used
+	bool valid = !memcmp(header->magic, "CBVH", 4) &&
+		header->version == CBVH_VERSION &&
+		header->transformSize == sizeof(Transform) &&
+		header->fileSize == cbvhFile->GetSize() &&
+		(!expectedSourceHash || header->sourceHash == expectedSourceHash) &&
+		header->jointsOffset + (uint64_t)header->jointCount * sizeof(CBVHJoint) <= header->namesOffset &&
+		header->namesOffset + header->namesSize <= header->rootPositionsOffset &&
+		header->rootPositionsOffset + (uint64_t)header->frameCount * header->rootCount * sizeof(vec3) <= header->tracksOffset &&
+		header->tracksOffset + (uint64_t)header->frameCount * header->trackCount * sizeof(Transform) <= header->fileSize;
+
+	if (!valid)
+	{
+		delete cbvhFile;
+		return NULL;
+	}
+
+	const CBVHJoint* joints = (const CBVHJoint*)(data + header->jointsOffset);
+	const char* names = data + header->namesOffset;
+	const Transform* tracks = (const Transform*)(data + header->tracksOffset);
+
+	// Rebuild the joint tree bottom up: in depth first order, children always come after their parent.
+	vector<vector<SkeletonJoint*>> jointChildren(header->jointCount);
+	vector<SkeletonJoint*> skeletonRoots;
+
+	for (int j = (int)header->jointCount - 1; j >= 0; j--)
+	{
+		const CBVHJoint& joint = joints[j];
+		if (joint.parentIndex < -1 || joint.parentIndex >= j || joint.nameOffset + (uint64_t)joint.nameLength > header->namesSize ||
+			joint.trackIndex < -1 || joint.trackIndex >= (int32_t)header->trackCount || joint.channelCount < 0 || joint.channelCount > 6)
+		{
+			// The joints built so far are in trees not yet attached to a parent
+			for (auto root : skeletonRoots)
+				DeleteJointRecursive(root);
+			for (int parentIndex = 0; parentIndex <= j; parentIndex++)
+			{
+				for (auto child : jointChildren[parentIndex])
+					DeleteJointRecursive(child);
+			}
+
+			delete cbvhFile;
+			return NULL;
+		}
+
+		string jointName(names + joint.nameOffset, joint.nameLength);
+		vec3 localOffset(joint.localOffset[0], joint.localOffset[1], joint.localOffset[2]);
+
+		vector<SkeletonJoint*>& children = jointChildren[j];
+		reverse(children.begin(), children.end());
+		SkeletonJoint* node = new SkeletonJoint(jointName, children, localOffset);
+
+		if (joint.parentIndex < 0)
+			skeletonRoots.insert(skeletonRoots.begin(), node);
+		else
+			jointChildren[joint.parentIndex].push_back(node);
+
+	}
+
+	SkeletalMotion* result = new SkeletalMotion(cbvhFilePath, vector<vec3>(), vector<Transform>(), skeletonRoots, header->samplingRate, header->frameCount);
+
+	// The rebuilt tree flattens back to the joints of the file, which the tracks are numbered after
+	const FlatSkeleton& skeleton = result->m_flatSkeleton;
+	bool sameSkeleton = skeletonRoots.size() == header->rootCount && skeleton.GetJointCount() == header->jointCount;
+	vector<int> channelAxes;
+	for (int j = 0; sameSkeleton && j < (int)header->jointCount; j++)
+	{
+		sameSkeleton = skeleton.parentIndices[j] == joints[j].parentIndex && skeleton.trackIndices[j] == joints[j].trackIndex;
+		channelAxes.insert(channelAxes.end(), joints[j].channels, joints[j].channels + joints[j].channelCount);
+	}
+
+	if (!sameSkeleton || skeleton.GetTrackCount() != header->trackCount)
+	{
+		for (auto root : skeletonRoots)
+			DeleteJointRecursive(root);
+
+		result->m_mappedFile = cbvhFile;
+		delete result;
+		return NULL;
+	}
+
+	result->m_rootPositions = (const vec3*)(data + header->rootPositionsOffset);
+	result->m_transformFrames = tracks;
+	result->SetChannelAxes(move(channelAxes));
+	result->m_mappedFile = cbvhFile;
+
+	return result;
+}
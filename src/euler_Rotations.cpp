@@ -0,0 +1,291 @@
+/*
+	CBVH++: Loads a skeletal animation
+	Copyright(C) 2017 Vincent Petrella
+
+	This program is free software : you can redistribute it and / or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+
+#include "euler_Rotations.h"
+#include "simd_Dispatch.h"
+#include <cmath>
+#include <iostream>
+#include <utility>
+
+#ifdef CBVH_X86
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+// Adding and subtracting 1.5 * 2^23 rounds to the nearest integer (ties to even) below 2^22, the same way in every path
+static const float s_roundingBias = 12582912.0f;
+static const float s_radiansPerDegree = 0.0174532925f;
+
+// Minimax polynomials of sin and cos over [-pi/4, pi/4] (Cephes)
+static const float s_sinCoefficients[3] = { -1.9515295891e-4f, 8.3321608736e-3f, -1.6666654611e-1f };
+static const float s_cosCoefficients[3] = { 2.443315711809948e-5f, -1.388731625493765e-3f, 4.166664568298827e-2f };
+
+void ComputeSinCosDegreesScalar(const float* angles, int count, float scale, float* sines, float* cosines)
+{
+	for (int i = 0; i < count; i++)
+	{
+		// Quarter turns are whole numbers of degrees: taking them off is exact, unlike a reduction in radians
+		float degrees = angles[i] * scale;
+		float quarterTurns = (degrees * (1.0f / 90.0f) + s_roundingBias) - s_roundingBias;
+		float x = (degrees - quarterTurns * 90.0f) * s_radiansPerDegree;
+
+		// What the vector conversion gives: out of range values and NaNs are in quadrant 0
+		int quadrant = fabsf(quarterTurns) < 2147483648.0f ? (int)quarterTurns & 3 : 0;
+
+		float z = x * x;
+		float sine = ((s_sinCoefficients[0] * z + s_sinCoefficients[1]) * z + s_sinCoefficients[2]) * z * x + x;
+		float cosine = ((s_cosCoefficients[0] * z + s_cosCoefficients[1]) * z + s_cosCoefficients[2]) * z * z - 0.5f * z + 1.0f;
+
+		// sin(x + 90) = cos(x), cos(x + 90) = -sin(x)
+		if (quadrant & 1)
+			swap(sine, cosine);
+
+		sines[i] = quadrant & 2 ? -sine : sine;
+		cosines[i] = (quadrant + 1) & 2 ? -cosine : cosine;
+	}
+}
+
+#ifdef CBVH_X86
+
+// Same steps as ComputeSinCosDegreesScalar, 4 angles at a time
+CBVH_TARGET("sse2") static void ComputeSinCosDegreesSSE2(const float* angles, int count, float scale, float* sines, float* cosines)
+{
+	int i = 0;
+	for (; i + 4 <= count; i += 4)
+	{
+		__m128 degrees = _mm_mul_ps(_mm_loadu_ps(angles + i), _mm_set1_ps(scale));
+		__m128 quarterTurns = _mm_sub_ps(_mm_add_ps(_mm_mul_ps(degrees, _mm_set1_ps(1.0f / 90.0f)), _mm_set1_ps(s_roundingBias)), _mm_set1_ps(s_roundingBias));
+		__m128 x = _mm_mul_ps(_mm_sub_ps(degrees, _mm_mul_ps(quarterTurns, _mm_set1_ps(90.0f))), _mm_set1_ps(s_radiansPerDegree));
+		__m128i quadrant = _mm_cvttps_epi32(quarterTurns);
+
+		__m128 z = _mm_mul_ps(x, x);
+		__m128 sine = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(s_sinCoefficients[0]), z), _mm_set1_ps(s_sinCoefficients[1])), z);
+		sine = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(_mm_add_ps(sine, _mm_set1_ps(s_sinCoefficients[2])), z), x), x);
+		__m128 cosine = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(s_cosCoefficients[0]), z), _mm_set1_ps(s_cosCoefficients[1])), z);
+		cosine = _mm_mul_ps(_mm_mul_ps(_mm_add_ps(cosine, _mm_set1_ps(s_cosCoefficients[2])), z), z);
+		cosine = _mm_add_ps(_mm_sub_ps(cosine, _mm_mul_ps(_mm_set1_ps(0.5f), z)), _mm_set1_ps(1.0f));
+
+		__m128 swapped = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(quadrant, _mm_set1_epi32(1)), _mm_set1_epi32(1)));
+		__m128 sineSign = _mm_castsi128_ps(_mm_slli_epi32(_mm_and_si128(quadrant, _mm_set1_epi32(2)), 30));
+		__m128 cosineSign = _mm_castsi128_ps(_mm_slli_epi32(_mm_and_si128(_mm_add_epi32(quadrant, _mm_set1_epi32(1)), _mm_set1_epi32(2)), 30));
+
+		_mm_storeu_ps(sines + i, _mm_xor_ps(_mm_or_ps(_mm_and_ps(swapped, cosine), _mm_andnot_ps(swapped, sine)), sineSign));
+		_mm_storeu_ps(cosines + i, _mm_xor_ps(_mm_or_ps(_mm_and_ps(swapped, sine), _mm_andnot_ps(swapped, cosine)), cosineSign));
+	}
+
+	ComputeSinCosDegreesScalar(angles + i, count - i, scale, sines + i, cosines + i);
+}
+
+// Same, 8 angles at a time
+CBVH_TARGET("avx2") static void ComputeSinCosDegreesAVX2(const float* angles, int count, float scale, float* sines, float* cosines)
+{
+	int i = 0;
+	for (; i + 8 <= count; i += 8)
+	{
+		__m256 degrees = _mm256_mul_ps(_mm256_loadu_ps(angles + i), _mm256_set1_ps(scale));
+		__m256 quarterTurns = _mm256_sub_ps(_mm256_add_ps(_mm256_mul_ps(degrees, _mm256_set1_ps(1.0f / 90.0f)), _mm256_set1_ps(s_roundingBias)), _mm256_set1_ps(s_roundingBias));
+		__m256 x = _mm256_mul_ps(_mm256_sub_ps(degrees, _mm256_mul_ps(quarterTurns, _mm256_set1_ps(90.0f))), _mm256_set1_ps(s_radiansPerDegree));
+		__m256i quadrant = _mm256_cvttps_epi32(quarterTurns);
+
+		__m256 z = _mm256_mul_ps(x, x);
+		__m256 sine = _mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(s_sinCoefficients[0]), z), _mm256_set1_ps(s_sinCoefficients[1])), z);
+		sine = _mm256_add_ps(_mm256_mul_ps(_mm256_mul_ps(_mm256_add_ps(sine, _mm256_set1_ps(s_sinCoefficients[2])), z), x), x);
+		__m256 cosine = _mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(s_cosCoefficients[0]), z), _mm256_set1_ps(s_cosCoefficients[1])), z);
+		cosine = _mm256_mul_ps(_mm256_mul_ps(_mm256_add_ps(cosine, _mm256_set1_ps(s_cosCoefficients[2])), z), z);
+		cosine = _mm256_add_ps(_mm256_sub_ps(cosine, _mm256_mul_ps(_mm256_set1_ps(0.5f), z)), _mm256_set1_ps(1.0f));
+
+		__m256 swapped = _mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_and_si256(quadrant, _mm256_set1_epi32(1)), _mm256_set1_epi32(1)));
+		__m256 sineSign = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_and_si256(quadrant, _mm256_set1_epi32(2)), 30));
+		__m256 cosineSign = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_and_si256(_mm256_add_epi32(quadrant, _mm256_set1_epi32(1)), _mm256_set1_epi32(2)), 30));
+
+		_mm256_storeu_ps(sines + i, _mm256_xor_ps(_mm256_blendv_ps(sine, cosine, swapped), sineSign));
+		_mm256_storeu_ps(cosines + i, _mm256_xor_ps(_mm256_blendv_ps(cosine, sine, swapped), cosineSign));
+	}
+
+	ComputeSinCosDegreesSSE2(angles + i, count - i, scale, sines + i, cosines + i);
+}
+
+#endif
+
+typedef void (*SinCosKernel)(const float*, int, float, float*, float*);
+
+// Indexed by SimdPath: frame rows are a few hundred angles, AVX-512 has nothing to add to the AVX2 kernel
+static const SinCosKernel s_sinCosKernels[SIMD_PATH_COUNT] =
+{
+	ComputeSinCosDegreesScalar,
+#ifdef CBVH_X86
+	ComputeSinCosDegreesSSE2,
+	ComputeSinCosDegreesSSE2,
+	ComputeSinCosDegreesAVX2,
+	ComputeSinCosDegreesAVX2,
+#else
+	ComputeSinCosDegreesScalar,
+	ComputeSinCosDegreesScalar,
+	ComputeSinCosDegreesScalar,
+	ComputeSinCosDegreesScalar,
+#endif
+};
+
+void ComputeSinCosDegrees(const float* angles, int count, float scale, float* sines, float* cosines)
+{
+	s_sinCosKernels[GetActiveSimdPath()](angles, count, scale, sines, cosines);
+}
+
+EulerOrder GetEulerOrder(const int axes[3])
+{
+	static const int orderAxes[EULER_ORDER_OTHER][3] = { { 0, 1, 2 }, { 0, 2, 1 }, { 1, 0, 2 }, { 1, 2, 0 }, { 2, 0, 1 }, { 2, 1, 0 } };
+
+	for (int order = 0; order < EULER_ORDER_OTHER; order++)
+	{
+		if (axes[0] == orderAxes[order][0] && axes[1] == orderAxes[order][1] && axes[2] == orderAxes[order][2])
+			return (EulerOrder)order;
+	}
+	return EULER_ORDER_OTHER;
+}
+
+/*
+	Rotation of a single channel. Matrices are built column by column, which makes each of them a rotation by minus the angle
+	(this is how the importer always read BVH files).
+*/
+template<int Axis> static mat3 AxisRotation(float sine, float cosine)
+{
+	if (Axis == 0)
+		return mat3(1, 0, 0, 0, cosine, -sine, 0, sine, cosine);
+	else if (Axis == 1)
+		return mat3(cosine, 0, sine, 0, 1, 0, -sine, 0, cosine);
+	else
+		return mat3(cosine, -sine, 0, sine, cosine, 0, 0, 0, 1);
+}
+
+// rotation * AxisRotation<Axis>: only the two columns other than Axis change
+template<int Axis> static mat3 RotateAxis(const mat3& rotation, float sine, float cosine)
+{
+	const int u = (Axis + 1) % 3;
+	const int v = (Axis + 2) % 3;
+
+	mat3 result = rotation;
+	result[u] = rotation[u] * cosine - rotation[v] * sine;
+	result[v] = rotation[u] * sine + rotation[v] * cosine;
+	return result;
+}
+
+// rotation * (cosine + sine * Axis), see glm's quaternion product
+template<int Axis> static quat RotateAxis(const quat& rotation, float sine, float cosine)
+{
+	const int u = (Axis + 1) % 3;
+	const int v = (Axis + 2) % 3;
+
+	quat result;
+	result.w = rotation.w * cosine - rotation[Axis] * sine;
+	result[Axis] = rotation.w * sine + rotation[Axis] * cosine;
+	result[u] = rotation[u] * cosine + rotation[v] * sine;
+	result[v] = rotation[v] * cosine - rotation[u] * sine;
+	return result;
+}
+
+template<int Axis> static quat AxisQuaternion(float sine, float cosine)
+{
+	quat result(cosine, 0, 0, 0);
+	result[Axis] = sine;
+	return result;
+}
+
+template<int A0, int A1, int A2> static mat3 ComposeEulerRotation(const float sines[3], const float cosines[3])
+{
+	return RotateAxis<A2>(RotateAxis<A1>(AxisRotation<A0>(sines[0], cosines[0]), sines[1], cosines[1]), sines[2], cosines[2]);
+}
+
+template<int A0, int A1, int A2> static quat ComposeEulerQuaternion(const float sines[3], const float cosines[3])
+{
+	return RotateAxis<A2>(RotateAxis<A1>(AxisQuaternion<A0>(sines[0], cosines[0]), sines[1], cosines[1]), sines[2], cosines[2]);
+}
+
+// Runtime axis, for the channel orders without a converter of their own
+template<typename Rotation> static Rotation RotateAxis(const Rotation& rotation, int axis, float sine, float cosine)
+{
+	switch (axis)
+	{
+	case 0:	return RotateAxis<0>(rotation, sine, cosine);
+	case 1:	return RotateAxis<1>(rotation, sine, cosine);
+	case 2:	return RotateAxis<2>(rotation, sine, cosine);
+	default:
+		std::cout << "Warning: Invalid rotation axis provided in bvh file...\n";
+		return rotation;
+	}
+}
+
+mat3 ComposeEulerRotation(EulerOrder order, const int axes[3], const float sines[3], const float cosines[3])
+{
+	switch (order)
+	{
+	case EULER_ORDER_XYZ:	return ComposeEulerRotation<0, 1, 2>(sines, cosines);
+	case EULER_ORDER_XZY:	return ComposeEulerRotation<0, 2, 1>(sines, cosines);
+	case EULER_ORDER_YXZ:	return ComposeEulerRotation<1, 0, 2>(sines, cosines);
+	case EULER_ORDER_YZX:	return ComposeEulerRotation<1, 2, 0>(sines, cosines);
+	case EULER_ORDER_ZXY:	return ComposeEulerRotation<2, 0, 1>(sines, cosines);
+	case EULER_ORDER_ZYX:	return ComposeEulerRotation<2, 1, 0>(sines, cosines);
+	default:
+	{
+		mat3 rotation = mat3(1);
+		for (int r = 0; r < 3; r++)
+			rotation = RotateAxis(rotation, axes[r], sines[r], cosines[r]);
+		return rotation;
+	}
+	}
+}
+
+quat ComposeEulerQuaternion(EulerOrder order, const int axes[3], const float halfSines[3], const float halfCosines[3])
+{
+	switch (order)
+	{
+	case EULER_ORDER_XYZ:	return ComposeEulerQuaternion<0, 1, 2>(halfSines, halfCosines);
+	case EULER_ORDER_XZY:	return ComposeEulerQuaternion<0, 2, 1>(halfSines, halfCosines);
+	case EULER_ORDER_YXZ:	return ComposeEulerQuaternion<1, 0, 2>(halfSines, halfCosines);
+	case EULER_ORDER_YZX:	return ComposeEulerQuaternion<1, 2, 0>(halfSines, halfCosines);
+	case EULER_ORDER_ZXY:	return ComposeEulerQuaternion<2, 0, 1>(halfSines, halfCosines);
+	case EULER_ORDER_ZYX:	return ComposeEulerQuaternion<2, 1, 0>(halfSines, halfCosines);
+	default:
+	{
+		// Unknown channels are skipped
+		quat rotation = quat();
+		for (int r = 0; r < 3; r++)
+		{
+			if (axes[r] >= 0 && axes[r] <= 2)
+				rotation = RotateAxis(rotation, axes[r], halfSines[r], halfCosines[r]);
+		}
+		return rotation;
+	}
+	}
+}
+
+mat3 ComposeEulerRotation(const int axes[3], vec3 angles)
+{
+	float sines[3], cosines[3];
+	ComputeSinCosDegreesScalar(&angles[0], 3, 1.0f, sines, cosines);
+	return ComposeEulerRotation(GetEulerOrder(axes), axes, sines, cosines);
+}
+
+quat ComposeEulerQuaternion(const int axes[3], vec3 angles)
+{
+	float halfSines[3], halfCosines[3];
+	ComputeSinCosDegreesScalar(&angles[0], 3, -0.5f, halfSines, halfCosines);
+	return ComposeEulerQuaternion(GetEulerOrder(axes), axes, halfSines, halfCosines);
+}
@@ -0,0 +1,77 @@
+/*
+	CBVH++: Loads a skeletal animation
+	Copyright(C) 2017 Vincent Petrella
+
+	This program is free software : you can redistribute it and / or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include "../include/glm/glm.hpp"
+#include "../include/glm/gtc/quaternion.hpp"
+
+using namespace glm;
+
+/*
+	Rotations of the BVH rotation channels.
+
+	A joint lists its three rotation channels in one of six orders (ZXY, XYZ, ...), and its rotation is the product of the
+	three axis rotations in that order. Each order has its own converter with the axes known at compile time, so a rotation
+	costs two partial 3x3 products instead of three full ones. Sines and cosines are computed for whole rows of angles at
+	once, with SIMD when the CPU has it (see simd_Dispatch.h). Results are bit-identical whatever the path.
+*/
+
+enum EulerOrder
+{
+	EULER_ORDER_XYZ,
+	EULER_ORDER_XZY,
+	EULER_ORDER_YXZ,
+	EULER_ORDER_YZX,
+	EULER_ORDER_ZXY,
+	EULER_ORDER_ZYX,
+	EULER_ORDER_OTHER	// Repeated or unknown axes, composed one axis at a time
+};
+
+// Order of three channel axes (0 for X, 1 for Y, 2 for Z, -1 for an unknown channel)
+EulerOrder GetEulerOrder(const int axes[3]);
+
+/*
+	ComputeSinCosDegrees:
+	sines[i] and cosines[i] of angles[i] * scale degrees, for count angles. Angles are reduced by quarter turns in degrees,
+	which is exact below 2^22 quarter turns; results are within 1e-7 of the exact values.
+*/
+void ComputeSinCosDegrees(const float* angles, int count, float scale, float* sines, float* cosines);
+
+/*
+	Same as ComputeSinCosDegrees, but never uses SIMD. This is the reference the vectorized path has to match.
+*/
+void ComputeSinCosDegreesScalar(const float* angles, int count, float scale, float* sines, float* cosines);
+
+/*
+	ComposeEulerRotation:
+	Rotation of a joint from the sines and cosines of its three rotation channels (ComputeSinCosDegrees with a scale of 1).
+*/
+mat3 ComposeEulerRotation(EulerOrder order, const int axes[3], const float sines[3], const float cosines[3]);
+
+/*
+	ComposeEulerQuaternion:
+	Same rotation as a quaternion, from the sines and cosines of the half angles (ComputeSinCosDegrees with a scale of -0.5:
+	the matrices of ComposeEulerRotation rotate by minus the angle, the quaternions follow the same convention).
+*/
+quat ComposeEulerQuaternion(EulerOrder order, const int axes[3], const float halfSines[3], const float halfCosines[3]);
+
+// Same as above, straight from the angles of the three channels, in degrees
+mat3 ComposeEulerRotation(const int axes[3], vec3 angles);
+quat ComposeEulerQuaternion(const int axes[3], vec3 angles);
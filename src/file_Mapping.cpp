@@ -0,0 +1,158 @@
+/*
+	CBVH++: Loads a skeletal animation
+	Copyright(C) 2017 Vincent Petrella
+
+	This program is free software : you can redistribute it and / or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "file_Mapping.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+FileMapping::FileMapping()
+{
+	m_data = NULL;
+	m_size = 0;
+	m_isOpen = false;
+#ifdef _WIN32
+	m_fileHandle = INVALID_HANDLE_VALUE;
+	m_mappingHandle = NULL;
+#endif
+}
+
+FileMapping::~FileMapping()
+{
+	Close();
+}
+
+#ifdef _WIN32
+
+bool FileMapping::Open(const std::string& filePath, FileAccess access)
+{
+	Close();
+
+	DWORD accessFlags = access == FILE_ACCESS_SEQUENTIAL ? FILE_FLAG_SEQUENTIAL_SCAN : FILE_ATTRIBUTE_NORMAL;
+	HANDLE file = CreateFileA(filePath.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, accessFlags, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(file, &fileSize))
+	{
+		CloseHandle(file);
+		return false;
+	}
+
+	m_fileHandle = file;
+	m_size = (uint64_t)fileSize.QuadPart;
+	m_isOpen = true;
+
+	// Windows refuses to map empty files, there is nothing to read anyway.
+	if (!m_size)
+		return true;
+
+	HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (!mapping)
+	{
+		Close();
+		return false;
+	}
+	m_mappingHandle = mapping;
+
+	m_data = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (!m_data)
+	{
+		Close();
+		return false;
+	}
+
+	return true;
+}
+
+void FileMapping::Close()
+{
+	if (m_data)
+		UnmapViewOfFile(m_data);
+	if (m_mappingHandle)
+		CloseHandle((HANDLE)m_mappingHandle);
+	if (m_fileHandle != INVALID_HANDLE_VALUE)
+		CloseHandle((HANDLE)m_fileHandle);
+
+	m_data = NULL;
+	m_size = 0;
+	m_isOpen = false;
+	m_fileHandle = INVALID_HANDLE_VALUE;
+	m_mappingHandle = NULL;
+}
+
+#else
+
+bool FileMapping::Open(const std::string& filePath, FileAccess access)
+{
+	Close();
+
+	int file = open(filePath.c_str(), O_RDONLY);
+	if (file < 0)
+		return false;
+
+	struct stat fileStats;
+	if (fstat(file, &fileStats) != 0)
+	{
+		close(file);
+		return false;
+	}
+
+	m_size = (uint64_t)fileStats.st_size;
+	m_isOpen = true;
+
+	if (m_size)
+	{
+		void* data = mmap(NULL, (size_t)m_size, PROT_READ, MAP_PRIVATE, file, 0);
+		if (data == MAP_FAILED)
+		{
+			close(file);
+			m_size = 0;
+			m_isOpen = false;
+			return false;
+		}
+		if (access == FILE_ACCESS_SEQUENTIAL)
+			madvise(data, (size_t)m_size, MADV_SEQUENTIAL);
+		m_data = (const char*)data;
+	}
+
+	// The mapping keeps its own reference to the file.
+	close(file);
+	return true;
+}
+
+void FileMapping::Close()
+{
+	if (m_data)
+		munmap((void*)m_data, (size_t)m_size);
+
+	m_data = NULL;
+	m_size = 0;
+	m_isOpen = false;
+}
+
+#endif
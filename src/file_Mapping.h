@@ -0,0 +1,71 @@
+/*
+	CBVH++: Loads a skeletal animation
+	Copyright(C) 2017 Vincent Petrella
+
+	This program is free software : you can redistribute it and / or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <string>
+#include <cstdint>
+
+/*
+	FileAccess:
+
+	How a mapping is going to be read, passed on to the OS so that it reads ahead (or not) accordingly.
+*/
+enum FileAccess
+{
+	FILE_ACCESS_NORMAL,		// Any order, pages are kept around: mappings that outlive the import (lazy decoding, binary caches)
+	FILE_ACCESS_SEQUENTIAL	// Front to back, once: pages behind the reader may be dropped early
+};
+
+/*
+	Class FileMapping:
+
+	Read-only memory mapping of a whole file. The mapped bytes stay valid until Close() is called
+	or the object is destroyed, so anything pointing into GetData() must not outlive it.
+*/
+class FileMapping
+{
+public:
+	FileMapping();
+	~FileMapping();
+
+	FileMapping(const FileMapping&) = delete;
+	FileMapping& operator=(const FileMapping&) = delete;
+
+	/*
+		Maps the file at filePath, to be read as access says. Returns false if the file could not be opened or mapped.
+		An empty file maps successfully, with a NULL data pointer and a size of 0.
+	*/
+	bool Open(const std::string& filePath, FileAccess access);
+
+	void Close();
+
+	bool			IsOpen()	const { return m_isOpen; }
+	const char*		GetData()	const { return m_data; }
+	uint64_t		GetSize()	const { return m_size; }
+
+private:
+	const char*	m_data;
+	uint64_t	m_size;
+	bool		m_isOpen;
+
+#ifdef _WIN32
+	void*		m_fileHandle;
+	void*		m_mappingHandle;
+#endif
+};
@@ -0,0 +1,303 @@
+/*
+	CBVH++: Loads a skeletal animation
+	Copyright(C) 2017 Vincent Petrella
+
+	This program is free software : you can redistribute it and / or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "file_Reader.h"
+
+#include <string.h>
+#include <stdint.h>
+#include <algorithm>
+
+#ifdef CBVH_WITH_ZLIB
+#include <zlib.h>
+#endif
+#ifdef CBVH_WITH_ZSTD
+#include <zstd.h>
+#endif
+
+// Compressed bytes read from the file at once
+static const size_t INPUT_BUFFER_SIZE = 256 << 10;
+
+FileReader::FileReader()
+{
+	m_file = NULL;
+	m_compression = COMPRESSION_NONE;
+	m_failed = false;
+	m_inputBegin = 0;
+	m_inputEnd = 0;
+	m_endOfInput = false;
+	m_endOfFrame = false;
+	m_decoder = NULL;
+}
+
+FileReader::~FileReader()
+{
+	Close();
+}
+
+FileReader::Compression FileReader::DetectCompression(const char* data, size_t size)
+{
+	if (size >= 2 && (unsigned char)data[0] == 0x1f && (unsigned char)data[1] == 0x8b)
+		return COMPRESSION_GZIP;
+
+	if (size >= 4 && (unsigned char)data[0] == 0x28 && (unsigned char)data[1] == 0xb5 && (unsigned char)data[2] == 0x2f && (unsigned char)data[3] == 0xfd)
+		return COMPRESSION_ZSTD;
+
+	return COMPRESSION_NONE;
+}
+
+bool FileReader::IsSupported(Compression compression)
+{
+	switch (compression)
+	{
+	case COMPRESSION_NONE:
+		return true;
+#ifdef CBVH_WITH_ZLIB
+	case COMPRESSION_GZIP:
+		return true;
+#endif
+#ifdef CBVH_WITH_ZSTD
+	case COMPRESSION_ZSTD:
+		return true;
+#endif
+	default:
+		return false;
+	}
+}
+
+size_t FileReader::GetTextSizeHint(Compression compression, const char* data, size_t size)
+{
+	// gzip compresses 1032:1 at best, bigger trailers are not sizes
+	if (compression == COMPRESSION_GZIP && size >= 18)
+	{
+		const unsigned char* trailer = (const unsigned char*)data + size - 4;
+		uint64_t textSize = trailer[0] | trailer[1] << 8 | trailer[2] << 16 | (uint64_t)trailer[3] << 24;
+		return textSize <= (uint64_t)size * 1032 ? (size_t)textSize : 0;
+	}
+
+#ifdef CBVH_WITH_ZSTD
+	if (compression == COMPRESSION_ZSTD)
+	{
+		unsigned long long textSize = ZSTD_getFrameContentSize(data, size);
+		return textSize != ZSTD_CONTENTSIZE_UNKNOWN && textSize != ZSTD_CONTENTSIZE_ERROR && textSize <= SIZE_MAX ? (size_t)textSize : 0;
+	}
+#endif
+
+	return 0;
+}
+
+const char* FileReader::GetCompressionName(Compression compression)
+{
+	switch (compression)
+	{
+	case COMPRESSION_GZIP:
+		return "gzip";
+	case COMPRESSION_ZSTD:
+		return "zstd";
+	default:
+		return "none";
+	}
+}
+
+bool FileReader::Open(const std::string& filePath)
+{
+	Close();
+
+	m_file = fopen(filePath.c_str(), "rb");
+	if (!m_file)
+		return false;
+
+	// The magic bytes stay in the input buffer, the decoder reads them again
+	m_input.resize(INPUT_BUFFER_SIZE);
+	m_inputEnd = fread(m_input.data(), 1, m_input.size(), m_file);
+	m_endOfInput = m_inputEnd < m_input.size();
+	m_compression = DetectCompression(m_input.data(), m_inputEnd);
+
+	if (!IsSupported(m_compression))
+	{
+		fclose(m_file);
+		m_file = NULL;
+		return false;
+	}
+
+#ifdef CBVH_WITH_ZLIB
+	if (m_compression == COMPRESSION_GZIP)
+	{
+		z_stream* stream = new z_stream();
+		// 32 + 15: gzip header, 32KB window
+		if (inflateInit2(stream, 32 + 15) != Z_OK)
+		{
+			delete stream;
+			Close();
+			return false;
+		}
+		m_decoder = stream;
+	}
+#endif
+#ifdef CBVH_WITH_ZSTD
+	if (m_compression == COMPRESSION_ZSTD)
+	{
+		ZSTD_DStream* stream = ZSTD_createDStream();
+		if (!stream || ZSTD_isError(ZSTD_initDStream(stream)))
+		{
+			ZSTD_freeDStream(stream);
+			Close();
+			return false;
+		}
+		m_decoder = stream;
+	}
+#endif
+
+	return true;
+}
+
+void FileReader::Close()
+{
+#ifdef CBVH_WITH_ZLIB
+	if (m_decoder && m_compression == COMPRESSION_GZIP)
+	{
+		inflateEnd((z_stream*)m_decoder);
+		delete (z_stream*)m_decoder;
+	}
+#endif
+#ifdef CBVH_WITH_ZSTD
+	if (m_decoder && m_compression == COMPRESSION_ZSTD)
+		ZSTD_freeDStream((ZSTD_DStream*)m_decoder);
+#endif
+
+	if (m_file)
+		fclose(m_file);
+
+	m_file = NULL;
+	m_compression = COMPRESSION_NONE;
+	m_failed = false;
+	m_input.clear();
+	m_inputBegin = 0;
+	m_inputEnd = 0;
+	m_endOfInput = false;
+	m_endOfFrame = false;
+	m_decoder = NULL;
+}
+
+size_t FileReader::Read(char* buffer, size_t size)
+{
+	if (!m_file || m_failed)
+		return 0;
+
+	size_t readSize = 0;
+
+	if (m_compression == COMPRESSION_NONE)
+	{
+		// What Open read ahead comes first
+		size_t bufferedSize = std::min(size, m_inputEnd - m_inputBegin);
+		memcpy(buffer, m_input.data() + m_inputBegin, bufferedSize);
+		m_inputBegin += bufferedSize;
+		readSize = bufferedSize;
+
+		if (readSize < size && !m_endOfInput)
+		{
+			readSize += fread(buffer + readSize, 1, size - readSize, m_file);
+			m_failed = ferror(m_file) != 0;
+		}
+		return readSize;
+	}
+
+	while (readSize < size && !m_failed)
+	{
+		if (m_inputBegin == m_inputEnd && !m_endOfInput)
+		{
+			m_inputBegin = 0;
+			m_inputEnd = fread(m_input.data(), 1, m_input.size(), m_file);
+			m_endOfInput = m_inputEnd < m_input.size();
+			m_failed = ferror(m_file) != 0;
+		}
+
+		size_t inputBegin = m_inputBegin;
+		size_t decompressedSize = Decompress(buffer + readSize, size - readSize);
+		readSize += decompressedSize;
+
+		// The decoder is stuck: past the end of the file, what was decoded must end a member or frame
+		if (!decompressedSize && m_inputBegin == inputBegin && m_endOfInput)
+		{
+			if (m_inputBegin != m_inputEnd || !m_endOfFrame)
+				m_failed = true;
+			break;
+		}
+	}
+
+	return readSize;
+}
+
+size_t FileReader::Decompress(char* output, size_t size)
+{
+#ifdef CBVH_WITH_ZLIB
+	if (m_compression == COMPRESSION_GZIP)
+	{
+		z_stream* stream = (z_stream*)m_decoder;
+		stream->next_in = (Bytef*)m_input.data() + m_inputBegin;
+		stream->avail_in = (uInt)(m_inputEnd - m_inputBegin);
+		stream->next_out = (Bytef*)output;
+		stream->avail_out = (uInt)std::min(size, (size_t)UINT32_MAX);
+
+		int status = inflate(stream, Z_NO_FLUSH);
+		size_t consumedSize = (m_inputEnd - m_inputBegin) - stream->avail_in;
+		size_t decompressedSize = (char*)stream->next_out - output;
+		m_inputBegin += consumedSize;
+
+		if (status == Z_STREAM_END)
+		{
+			// Concatenated files are concatenated members (gzip -c a b), go on with the next one if any
+			m_endOfFrame = true;
+			inflateReset(stream);
+		}
+		else if (status == Z_OK || status == Z_BUF_ERROR)
+		{
+			if (consumedSize || decompressedSize)
+				m_endOfFrame = false;
+		}
+		else
+		{
+			m_failed = true;
+		}
+		return decompressedSize;
+	}
+#endif
+#ifdef CBVH_WITH_ZSTD
+	if (m_compression == COMPRESSION_ZSTD)
+	{
+		ZSTD_inBuffer input = { m_input.data() + m_inputBegin, m_inputEnd - m_inputBegin, 0 };
+		ZSTD_outBuffer decompressed = { output, size, 0 };
+
+		// Frames follow each other on their own, 0 means the last one ended and was flushed whole
+		size_t status = ZSTD_decompressStream((ZSTD_DStream*)m_decoder, &decompressed, &input);
+		m_inputBegin += input.pos;
+
+		if (ZSTD_isError(status))
+			m_failed = true;
+		else if (input.pos || decompressed.pos)
+			m_endOfFrame = status == 0;
+
+		return decompressed.pos;
+	}
+#endif
+
+	// Built without the decoder of m_compression, Open refuses such files
+	(void)output;
+	(void)size;
+	m_failed = true;
+	return 0;
+}
@@ -0,0 +1,94 @@
+/*
+	CBVH++: Loads a skeletal animation
+	Copyright(C) 2017 Vincent Petrella
+
+	This program is free software : you can redistribute it and / or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdio>
+
+/*
+	Class FileReader:
+
+	Reads a file front to back, a buffer at a time. Files compressed with gzip or zstd (told apart by their first bytes) are
+	decompressed on the fly through a fixed size input buffer: Read() always returns the text, nothing is written to disk.
+	Reading gzip needs a build with CBVH_WITH_ZLIB defined (linking zlib), zstd one with CBVH_WITH_ZSTD (linking libzstd).
+*/
+class FileReader
+{
+public:
+	enum Compression
+	{
+		COMPRESSION_NONE,
+		COMPRESSION_GZIP,
+		COMPRESSION_ZSTD
+	};
+
+	FileReader();
+	~FileReader();
+
+	FileReader(const FileReader&) = delete;
+	FileReader& operator=(const FileReader&) = delete;
+
+	/*
+		Opens the file at filePath. Returns false if it could not be opened, or is compressed in a format this build cannot
+		read (GetCompression() then tells which one).
+	*/
+	bool Open(const std::string& filePath);
+
+	void Close();
+
+	/*
+		Reads up to size bytes of text into buffer. Returns the number of bytes read, fewer than size only at the end of the file,
+		or when it is unreadable (see Failed).
+	*/
+	size_t Read(char* buffer, size_t size);
+
+	// True if reading stopped on corrupted or truncated compressed data, or on a read error.
+	bool			Failed()			const { return m_failed; }
+	Compression		GetCompression()	const { return m_compression; }
+
+	// Compression format of data starting with the size bytes at data
+	static Compression	DetectCompression(const char* data, size_t size);
+	static bool			IsSupported(Compression compression);
+
+	/*
+		Size of the text compressed in the size bytes at data, as far as the file tells without decompressing it
+		(gzip: size of the last member, zstd: size of the first frame when it is recorded). 0 when it does not.
+		Only meant to size buffers with.
+	*/
+	static size_t		GetTextSizeHint(Compression compression, const char* data, size_t size);
+	static const char*	GetCompressionName(Compression compression);
+
+private:
+	// Runs the decoder on the input buffer into [output, output + size). Returns the number of bytes written.
+	size_t Decompress(char* output, size_t size);
+
+	FILE*				m_file;
+	Compression			m_compression;
+	bool				m_failed;
+
+	// Compressed input: bytes [m_inputBegin, m_inputEnd) of m_input are still to be decoded
+	std::vector<char>	m_input;
+	size_t				m_inputBegin;
+	size_t				m_inputEnd;
+	bool				m_endOfInput;
+	bool				m_endOfFrame;		// Everything decoded so far ends a complete gzip member or zstd frame
+
+	void*				m_decoder;			// z_stream or ZSTD_DStream
+};
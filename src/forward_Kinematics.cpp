@@ -0,0 +1,233 @@
+/*
+	CBVH++: Loads a skeletal animation
+	Copyright(C) 2017 Vincent Petrella
+
+	This program is free software : you can redistribute it and / or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include "forward_Kinematics.h"
+#include "simd_Dispatch.h"
+#include <vector>
+#include <climits>
+#include <algorithm>
+#include <cstdint>
+
+#ifdef CBVH_X86
+#include <immintrin.h>
+#endif
+
+static_assert(sizeof(Transform) == 12 * sizeof(float), "Transform::GetData expects the rotation and origin to be packed");
+
+void ComputeJointPosesScalar(const FlatSkeleton& skeleton,
+	int rootIndex,
+	const Transform& rootTransform,
+	const Transform* localTransforms,
+	float scale,
+	vec3* jointPositions,
+	Transform* cumulativeTransforms,
+	pair<vec3, vec3>* segmentPositions)
+{
+	int subtreeEnd = skeleton.subtreeEnds[rootIndex];
+
+	// World pose of the frame the children of each joint are expressed in (cumulative transform composed with the local one).
+	// Kept per thread so that queries do not allocate once warm, and stay safe to run concurrently.
+	static thread_local vector<Transform> childFramesBuffer;
+	if (childFramesBuffer.size() < subtreeEnd - rootIndex)
+		childFramesBuffer.resize(subtreeEnd - rootIndex);
+	Transform* childFrames = childFramesBuffer.data();
+
+	for (int jointIndex = rootIndex; jointIndex < subtreeEnd; jointIndex++)
+	{
+		int parentIndex = skeleton.parentIndices[jointIndex];
+		int trackIndex = skeleton.trackIndices[jointIndex];
+		const Transform& cumulativeTransform = parentIndex < 0 ? rootTransform : childFrames[parentIndex - rootIndex];
+
+		vec3 jointPositionW = cumulativeTransform.TransformPoint(skeleton.localOffsets[jointIndex]) * scale;
+
+		if (trackIndex >= 0) // Leaf joints do not have transforms, let's not try looking for them
+			childFrames[jointIndex - rootIndex] = cumulativeTransform * localTransforms[trackIndex];
+
+		if (jointPositions)
+			jointPositions[jointIndex] = jointPositionW;
+
+		if (cumulativeTransforms)
+			cumulativeTransforms[jointIndex] = cumulativeTransform;
+
+		if (segmentPositions && parentIndex >= 0)
+			segmentPositions[jointIndex] = pair<vec3, vec3>(cumulativeTransform.GetOrigin() * scale, jointPositionW);
+	}
+}
+
+#ifdef CBVH_X86
+
+// Vector operations of the lane kernels, one frame per lane (see ComputeJointPosesLanes)
+struct LanesSSE
+{
+	typedef __m128 Vector;
+	static const int count = 4;
+
+	CBVH_TARGET("sse2") static Vector Set1(float value) { return _mm_set1_ps(value); }
+	CBVH_TARGET("sse2") static Vector Load(const float* values) { return _mm_load_ps(values); }
+	CBVH_TARGET("sse2") static void Store(float* values, Vector vector) { _mm_store_ps(values, vector); }
+	CBVH_TARGET("sse2") static Vector Add(Vector a, Vector b) { return _mm_add_ps(a, b); }
+	CBVH_TARGET("sse2") static Vector Mul(Vector a, Vector b) { return _mm_mul_ps(a, b); }
+	CBVH_TARGET("sse2") static Vector Gather(const float* base, const int* offsets) { return _mm_setr_ps(base[offsets[0]], base[offsets[1]], base[offsets[2]], base[offsets[3]]); }
+};
+
+struct LanesAVX2
+{
+	typedef __m256 Vector;
+	static const int count = 8;
+
+	CBVH_TARGET("avx2") static Vector Set1(float value) { return _mm256_set1_ps(value); }
+	CBVH_TARGET("avx2") static Vector Load(const float* values) { return _mm256_load_ps(values); }
+	CBVH_TARGET("avx2") static void Store(float* values, Vector vector) { _mm256_store_ps(values, vector); }
+	CBVH_TARGET("avx2") static Vector Add(Vector a, Vector b) { return _mm256_add_ps(a, b); }
+	CBVH_TARGET("avx2") static Vector Mul(Vector a, Vector b) { return _mm256_mul_ps(a, b); }
+	CBVH_TARGET("avx2") static Vector Gather(const float* base, const int* offsets) { return _mm256_i32gather_ps(base, _mm256_load_si256((const __m256i*)offsets), 4); }
+};
+
+struct LanesAVX512
+{
+	typedef __m512 Vector;
+	static const int count = 16;
+
+	CBVH_TARGET("avx512f") static Vector Set1(float value) { return _mm512_set1_ps(value); }
+	CBVH_TARGET("avx512f") static Vector Load(const float* values) { return _mm512_load_ps(values); }
+	CBVH_TARGET("avx512f") static void Store(float* values, Vector vector) { _mm512_store_ps(values, vector); }
+	// AVX-512F has fused multiply-adds, which the compiler could otherwise form out of these and round differently.
+	// The masked forms take zeros for the lanes they leave alone (none here): the plain ones start from undefined registers.
+	CBVH_TARGET("avx512f") static Vector Add(Vector a, Vector b) { return _mm512_maskz_add_round_ps(0xffff, a, b, _MM_FROUND_CUR_DIRECTION); }
+	CBVH_TARGET("avx512f") static Vector Mul(Vector a, Vector b) { return _mm512_maskz_mul_round_ps(0xffff, a, b, _MM_FROUND_CUR_DIRECTION); }
+	CBVH_TARGET("avx512f") static Vector Gather(const float* base, const int* offsets) { return _mm512_mask_i32gather_ps(_mm512_setzero_ps(), 0xffff, _mm512_load_si512(offsets), base, 4); }
+};
+
+namespace SSE2
+{
+	typedef LanesSSE FrameLanes;
+
+#define CBVH_KERNEL CBVH_TARGET("sse2")
+#include "forward_Kinematics_Kernels.inl"
+#undef CBVH_KERNEL
+}
+
+namespace AVX2
+{
+	typedef LanesAVX2 FrameLanes;
+
+#define CBVH_KERNEL CBVH_TARGET("avx2")
+#include "forward_Kinematics_Kernels.inl"
+#undef CBVH_KERNEL
+}
+
+namespace AVX512
+{
+	typedef LanesAVX512 FrameLanes;
+
+#define CBVH_KERNEL CBVH_TARGET("avx512f")
+#include "forward_Kinematics_Kernels.inl"
+#undef CBVH_KERNEL
+}
+
+#endif
+
+typedef void (*JointPosesKernel)(const FlatSkeleton&, int, const Transform&, const Transform*, float, vec3*, Transform*, pair<vec3, vec3>*);
+typedef void (*FrameLanesKernel)(const FlatSkeleton&, int, const Transform*, size_t, const vec3*, size_t, float, vec3*, Transform*);
+
+struct JointPosesKernels
+{
+	JointPosesKernel	poseJoints;			// A frame, a joint at a time
+	FrameLanesKernel	poseFrameLanes;		// frameLaneCount frames at once, NULL when frames go one at a time
+	int					frameLaneCount;
+};
+
+// Indexed by SimdPath
+static const JointPosesKernels s_jointPosesKernels[SIMD_PATH_COUNT] =
+{
+	{ ComputeJointPosesScalar, NULL, 1 },
+#ifdef CBVH_X86
+	{ SSE2::ComputeJointPoses, SSE2::ComputeJointPosesFrameLanes, SSE2::FrameLanes::count },
+	{ SSE2::ComputeJointPoses, SSE2::ComputeJointPosesFrameLanes, SSE2::FrameLanes::count },
+	{ AVX2::ComputeJointPoses, AVX2::ComputeJointPosesFrameLanes, AVX2::FrameLanes::count },
+	{ AVX512::ComputeJointPoses, AVX512::ComputeJointPosesFrameLanes, AVX512::FrameLanes::count },
+#else
+	{ ComputeJointPosesScalar, NULL, 1 },
+	{ ComputeJointPosesScalar, NULL, 1 },
+	{ ComputeJointPosesScalar, NULL, 1 },
+	{ ComputeJointPosesScalar, NULL, 1 },
+#endif
+};
+
+void ComputeJointPoses(const FlatSkeleton& skeleton,
+	int rootIndex,
+	const Transform& rootTransform,
+	const Transform* localTransforms,
+	float scale,
+	vec3* jointPositions,
+	Transform* cumulativeTransforms,
+	pair<vec3, vec3>* segmentPositions)
+{
+	s_jointPosesKernels[GetActiveSimdPath()].poseJoints(skeleton, rootIndex, rootTransform, localTransforms, scale, jointPositions, cumulativeTransforms, segmentPositions);
+}
+
+void ComputeJointPosesFrames(const FlatSkeleton& skeleton,
+	int rootIndex,
+	int frameCount,
+	const Transform* localTransforms,
+	size_t localTransformsStride,
+	const vec3* rootOrigins,
+	size_t rootOriginsStride,
+	float scale,
+	vec3* jointPositions,
+	Transform* cumulativeTransforms)
+{
+	const JointPosesKernels& kernels = s_jointPosesKernels[GetActiveSimdPath()];
+	size_t jointCount = skeleton.GetJointCount();
+	int laneCount = kernels.frameLaneCount;
+	int frame = 0;
+
+	// Gathers address the frames with 32 bit offsets
+	if (kernels.poseFrameLanes && localTransformsStride * 12 * laneCount < INT_MAX)
+	{
+		for (; frame + laneCount <= frameCount; frame += laneCount)
+		{
+			kernels.poseFrameLanes(skeleton,
+				rootIndex,
+				localTransforms + frame * localTransformsStride,
+				localTransformsStride,
+				rootOrigins ? rootOrigins + frame * rootOriginsStride : NULL,
+				rootOriginsStride,
+				scale,
+				jointPositions ? jointPositions + frame * jointCount : NULL,
+				cumulativeTransforms ? cumulativeTransforms + frame * jointCount : NULL);
+		}
+	}
+
+	for (; frame < frameCount; frame++)
+	{
+		Transform rootTransform = Transform();
+		if (rootOrigins)
+			rootTransform.SetOrigin(rootOrigins[frame * rootOriginsStride]);
+
+		kernels.poseJoints(skeleton,
+			rootIndex,
+			rootTransform,
+			localTransforms + frame * localTransformsStride,
+			scale,
+			jointPositions ? jointPositions + frame * jointCount : NULL,
+			cumulativeTransforms ? cumulativeTransforms + frame * jointCount : NULL,
+			NULL);
+	}
+}
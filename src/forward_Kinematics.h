@@ -0,0 +1,77 @@
+/*
+	CBVH++: Loads a skeletal animation
+	Copyright(C) 2017 Vincent Petrella
+
+	This program is free software : you can redistribute it and / or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include "animation.h"
+
+/*
+	Forward kinematics for a FlatSkeleton.
+
+	Composes the local transforms of the joints of one skeleton down from its root, parents first, and writes the pose
+	at the joint indices (see SkeletalMotion::QuerySkeletalAnimation). Cumulative transforms are kept in 16 byte aligned
+	columns and composed with SSE; either way, results are bit-identical to composing Transforms.
+
+	Within a frame, every joint waits on its parent. Across frames, the same joint is independent: ComputeJointPosesFrames
+	poses 4 frames at a time with SSE, 8 with AVX2 and 16 with AVX-512, one frame per vector lane.
+	Each kernel is compiled for every instruction set, calls go to the one of GetActiveSimdPath() (see simd_Dispatch.h).
+*/
+
+/*
+	ComputeJointPoses:
+	Poses the joints [rootIndex, skeleton.subtreeEnds[rootIndex]). localTransforms[t] is the local transform of track t,
+	only the tracks of that skeleton are read. Positions and segments are scaled by scale. Outputs may be null.
+*/
+void ComputeJointPoses(const FlatSkeleton& skeleton,
+	int rootIndex,
+	const Transform& rootTransform,
+	const Transform* localTransforms,
+	float scale,
+	vec3* jointPositions,
+	Transform* cumulativeTransforms,
+	pair<vec3, vec3>* segmentPositions);
+
+/*
+	Same as ComputeJointPoses, but never uses SIMD. This is the reference the vectorized path has to match.
+*/
+void ComputeJointPosesScalar(const FlatSkeleton& skeleton,
+	int rootIndex,
+	const Transform& rootTransform,
+	const Transform* localTransforms,
+	float scale,
+	vec3* jointPositions,
+	Transform* cumulativeTransforms,
+	pair<vec3, vec3>* segmentPositions);
+
+/*
+	ComputeJointPosesFrames:
+	ComputeJointPoses for frameCount frames. Frame f reads its local transforms at localTransforms + f * localTransformsStride
+	and its root origin at rootOrigins[f * rootOriginsStride] (the origin when rootOrigins is null), and writes row f of the
+	outputs, which are skeleton.GetJointCount() entries long. Results are the same as posing the frames one by one.
+*/
+void ComputeJointPosesFrames(const FlatSkeleton& skeleton,
+	int rootIndex,
+	int frameCount,
+	const Transform* localTransforms,
+	size_t localTransformsStride,
+	const vec3* rootOrigins,
+	size_t rootOriginsStride,
+	float scale,
+	vec3* jointPositions,
+	Transform* cumulativeTransforms);
@@ -0,0 +1,227 @@
+/*
+	CBVH++: Loads a skeletal animation
+	Copyright(C) 2017 Vincent Petrella
+
+	This program is free software : you can redistribute it and / or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+/*
+	The SIMD kernels of forward_Kinematics.cpp, included there once per instruction set: in a namespace that defines
+	FrameLanes (see LanesSSE), with CBVH_KERNEL set to the matching CBVH_TARGET.
+*/
+
+// A Transform as four columns (the rotation, then the origin) with a zero fourth lane.
+struct alignas(16) AffineColumns
+{
+	__m128 columns[4];
+};
+
+CBVH_KERNEL inline AffineColumns LoadAffineColumns(const Transform& transform)
+{
+	const float* values = transform.GetData();
+
+	AffineColumns result;
+	for (int c = 0; c < 4; c++)
+		result.columns[c] = _mm_setr_ps(values[c * 3], values[c * 3 + 1], values[c * 3 + 2], 0.0f);
+	return result;
+}
+
+CBVH_KERNEL inline vec3 ToVec3(__m128 value)
+{
+	alignas(16) float lanes[4];
+	_mm_store_ps(lanes, value);
+	return vec3(lanes[0], lanes[1], lanes[2]);
+}
+
+// frame.rotation * vector (+ frame.origin for a point), summed in the order glm does so that results match the scalar path.
+CBVH_KERNEL inline __m128 TransformAffine(const AffineColumns& frame, const float* vector, bool point)
+{
+	__m128 result = _mm_add_ps(_mm_add_ps(
+		_mm_mul_ps(frame.columns[0], _mm_set1_ps(vector[0])),
+		_mm_mul_ps(frame.columns[1], _mm_set1_ps(vector[1]))),
+		_mm_mul_ps(frame.columns[2], _mm_set1_ps(vector[2])));
+
+	return point ? _mm_add_ps(result, frame.columns[3]) : result;
+}
+
+CBVH_KERNEL void ComputeJointPoses(const FlatSkeleton& skeleton,
+	int rootIndex,
+	const Transform& rootTransform,
+	const Transform* localTransforms,
+	float scale,
+	vec3* jointPositions,
+	Transform* cumulativeTransforms,
+	pair<vec3, vec3>* segmentPositions)
+{
+	int subtreeEnd = skeleton.subtreeEnds[rootIndex];
+
+	static thread_local vector<AffineColumns> childFramesBuffer;
+	if (childFramesBuffer.size() < subtreeEnd - rootIndex)
+		childFramesBuffer.resize(subtreeEnd - rootIndex);
+	AffineColumns* childFrames = childFramesBuffer.data();
+
+	AffineColumns rootFrame = LoadAffineColumns(rootTransform);
+	__m128 scaleFactor = _mm_set1_ps(scale);
+
+	for (int jointIndex = rootIndex; jointIndex < subtreeEnd; jointIndex++)
+	{
+		int parentIndex = skeleton.parentIndices[jointIndex];
+		int trackIndex = skeleton.trackIndices[jointIndex];
+		const AffineColumns& cumulativeFrame = parentIndex < 0 ? rootFrame : childFrames[parentIndex - rootIndex];
+
+		__m128 jointPositionW = _mm_mul_ps(TransformAffine(cumulativeFrame, &skeleton.localOffsets[jointIndex][0], true), scaleFactor);
+
+		if (trackIndex >= 0) // Leaf joints do not have transforms, let's not try looking for them
+		{
+			// Columns of the composed transform: the local rotation columns are rotated, the local origin is transformed
+			const float* local = localTransforms[trackIndex].GetData();
+			AffineColumns& childFrame = childFrames[jointIndex - rootIndex];
+			childFrame.columns[0] = TransformAffine(cumulativeFrame, local, false);
+			childFrame.columns[1] = TransformAffine(cumulativeFrame, local + 3, false);
+			childFrame.columns[2] = TransformAffine(cumulativeFrame, local + 6, false);
+			childFrame.columns[3] = TransformAffine(cumulativeFrame, local + 9, true);
+		}
+
+		if (jointPositions)
+			jointPositions[jointIndex] = ToVec3(jointPositionW);
+
+		if (cumulativeTransforms)
+		{
+			mat3 rotation(ToVec3(cumulativeFrame.columns[0]), ToVec3(cumulativeFrame.columns[1]), ToVec3(cumulativeFrame.columns[2]));
+			cumulativeTransforms[jointIndex] = Transform(rotation, ToVec3(cumulativeFrame.columns[3]));
+		}
+
+		if (segmentPositions && parentIndex >= 0)
+			segmentPositions[jointIndex] = pair<vec3, vec3>(ToVec3(_mm_mul_ps(cumulativeFrame.columns[3], scaleFactor)), ToVec3(jointPositionW));
+	}
+}
+
+/*
+	Poses Lanes::count frames of a skeleton at once (see ComputeJointPosesFrames). A frame holds the 12 values of a Transform
+	(rotation columns, then origin), each as a vector of the value in every frame. Sums run in the order glm uses.
+*/
+template <typename Lanes>
+CBVH_KERNEL void ComputeJointPosesLanes(const FlatSkeleton& skeleton,
+	int rootIndex,
+	const Transform* localTransforms,
+	size_t localTransformsStride,
+	const vec3* rootOrigins,
+	size_t rootOriginsStride,
+	float scale,
+	vec3* jointPositions,
+	Transform* cumulativeTransforms)
+{
+	typedef typename Lanes::Vector Vector;
+	struct LaneFrames { Vector values[12]; };
+
+	const int laneCount = Lanes::count;
+	int subtreeEnd = skeleton.subtreeEnds[rootIndex];
+	size_t jointCount = skeleton.GetJointCount();
+
+	// Outside of the kernel's target, vector types can be less aligned than inside: the frames are aligned by hand
+	static thread_local vector<char> childFramesBuffer;
+	size_t childFramesSize = (subtreeEnd - rootIndex) * sizeof(LaneFrames) + sizeof(Vector);
+	if (childFramesBuffer.size() < childFramesSize)
+		childFramesBuffer.resize(childFramesSize);
+	LaneFrames* childFrames = (LaneFrames*)(((uintptr_t)childFramesBuffer.data() + sizeof(Vector) - 1) & ~(uintptr_t)(sizeof(Vector) - 1));
+
+	// Offset of each frame's local transforms, in floats
+	alignas(64) int frameOffsets[laneCount];
+	for (int lane = 0; lane < laneCount; lane++)
+		frameOffsets[lane] = (int)(lane * localTransformsStride * 12);
+
+	alignas(64) float laneValues[12][laneCount];
+
+	LaneFrames rootFrame;
+	for (int v = 0; v < 9; v++)
+		rootFrame.values[v] = Lanes::Set1(v % 4 ? 0.0f : 1.0f);
+	for (int r = 0; r < 3; r++)
+	{
+		for (int lane = 0; lane < laneCount; lane++)
+			laneValues[r][lane] = rootOrigins ? rootOrigins[lane * rootOriginsStride][r] : 0.0f;
+		rootFrame.values[9 + r] = Lanes::Load(laneValues[r]);
+	}
+
+	Vector scaleFactor = Lanes::Set1(scale);
+
+	for (int jointIndex = rootIndex; jointIndex < subtreeEnd; jointIndex++)
+	{
+		int parentIndex = skeleton.parentIndices[jointIndex];
+		int trackIndex = skeleton.trackIndices[jointIndex];
+		const Vector* cumulativeFrame = parentIndex < 0 ? rootFrame.values : childFrames[parentIndex - rootIndex].values;
+
+		if (jointPositions)
+		{
+			const vec3& jointPositionL = skeleton.localOffsets[jointIndex];
+			Vector x = Lanes::Set1(jointPositionL.x), y = Lanes::Set1(jointPositionL.y), z = Lanes::Set1(jointPositionL.z);
+
+			for (int r = 0; r < 3; r++)
+			{
+				Vector rotated = Lanes::Add(Lanes::Add(Lanes::Mul(cumulativeFrame[r], x), Lanes::Mul(cumulativeFrame[3 + r], y)), Lanes::Mul(cumulativeFrame[6 + r], z));
+				Lanes::Store(laneValues[r], Lanes::Mul(Lanes::Add(rotated, cumulativeFrame[9 + r]), scaleFactor));
+			}
+
+			for (int lane = 0; lane < laneCount; lane++)
+				jointPositions[lane * jointCount + jointIndex] = vec3(laneValues[0][lane], laneValues[1][lane], laneValues[2][lane]);
+		}
+
+		if (cumulativeTransforms)
+		{
+			for (int v = 0; v < 12; v++)
+				Lanes::Store(laneValues[v], cumulativeFrame[v]);
+
+			for (int lane = 0; lane < laneCount; lane++)
+			{
+				mat3 rotation(
+					laneValues[0][lane], laneValues[1][lane], laneValues[2][lane],
+					laneValues[3][lane], laneValues[4][lane], laneValues[5][lane],
+					laneValues[6][lane], laneValues[7][lane], laneValues[8][lane]);
+				cumulativeTransforms[lane * jointCount + jointIndex] = Transform(rotation, vec3(laneValues[9][lane], laneValues[10][lane], laneValues[11][lane]));
+			}
+		}
+
+		if (trackIndex < 0) // Leaf joints do not have transforms, let's not try looking for them
+			continue;
+
+		// Each column of the local transform (gathered from every frame) is rotated, the origin column is also translated
+		const float* local = localTransforms[trackIndex].GetData();
+		Vector* childFrame = childFrames[jointIndex - rootIndex].values;
+		for (int c = 0; c < 4; c++)
+		{
+			Vector x = Lanes::Gather(local + c * 3, frameOffsets);
+			Vector y = Lanes::Gather(local + c * 3 + 1, frameOffsets);
+			Vector z = Lanes::Gather(local + c * 3 + 2, frameOffsets);
+
+			for (int r = 0; r < 3; r++)
+			{
+				Vector column = Lanes::Add(Lanes::Add(Lanes::Mul(cumulativeFrame[r], x), Lanes::Mul(cumulativeFrame[3 + r], y)), Lanes::Mul(cumulativeFrame[6 + r], z));
+				childFrame[c * 3 + r] = c == 3 ? Lanes::Add(column, cumulativeFrame[9 + r]) : column;
+			}
+		}
+	}
+}
+
+CBVH_KERNEL void ComputeJointPosesFrameLanes(const FlatSkeleton& skeleton,
+	int rootIndex,
+	const Transform* localTransforms,
+	size_t localTransformsStride,
+	const vec3* rootOrigins,
+	size_t rootOriginsStride,
+	float scale,
+	vec3* jointPositions,
+	Transform* cumulativeTransforms)
+{
+	ComputeJointPosesLanes<FrameLanes>(skeleton, rootIndex, localTransforms, localTransformsStride, rootOrigins, rootOriginsStride, scale, jointPositions, cumulativeTransforms);
+}
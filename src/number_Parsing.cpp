@@ -0,0 +1,228 @@
+/*
+	CBVH++: Loads a skeletal animation
+	Copyright(C) 2017 Vincent Petrella
+
+	This program is free software : you can redistribute it and / or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include "number_Parsing.h"
+#include "simd_Dispatch.h"
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <cfloat>
+
+#ifdef CBVH_X86
+#include <immintrin.h>
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+using namespace std;
+
+// Parses a single value ending at the first separator (or at end).
+static const char* ParseFloatScalar(const char* cursor, const char* end, float* value)
+{
+	const char* tokenEnd = cursor;
+	while (tokenEnd < end && !IsTokenSeparator(*tokenEnd))
+		tokenEnd++;
+
+	// from_chars does not accept the leading '+' some exporters write
+	const char* first = cursor;
+	if (tokenEnd - first > 1 && *first == '+')
+		first++;
+
+	from_chars_result result = from_chars(first, tokenEnd, *value);
+	if (result.ec != errc() || result.ptr != tokenEnd)
+		return NULL;
+
+	return tokenEnd;
+}
+
+const char* ParseFloatRowScalar(const char* cursor, const char* end, float* values, int count)
+{
+	for (int i = 0; i < count; i++)
+	{
+		cursor = SkipTokenSeparators(cursor, end);
+		if (cursor == end)
+			return NULL;
+
+		cursor = ParseFloatScalar(cursor, end, values + i);
+		if (!cursor)
+			return NULL;
+	}
+	return cursor;
+}
+
+#ifdef CBVH_X86
+
+static const double s_powersOfTen[] =
+{
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15
+};
+
+inline int CountTrailingZeros(uint32_t mask)
+{
+#if defined(_MSC_VER)
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return (int)index;
+#else
+	return __builtin_ctz(mask);
+#endif
+}
+
+/*
+	Where the digits of a plain decimal ([-]ddd[.ddd], no exponent) sit, relative to the first digit.
+	Only layouts whose terminator falls inside a 16 byte window are handled by the vector path.
+*/
+struct DecimalLayout
+{
+	int intDigits;
+	int fracDigits;
+	int span;		// intDigits + fracDigits, plus one if there is a dot
+};
+
+// digitMask / dotMask have bit i set when character i after the sign is a digit / a dot.
+inline bool ReadDecimalLayout(uint32_t digitMask, uint32_t dotMask, DecimalLayout& layout)
+{
+	layout.intDigits = CountTrailingZeros(~digitMask);
+	layout.fracDigits = 0;
+	layout.span = layout.intDigits;
+
+	if (layout.intDigits < 16 && ((dotMask >> layout.intDigits) & 1))
+	{
+		layout.fracDigits = CountTrailingZeros(~(digitMask >> (layout.intDigits + 1)));
+		layout.span = layout.intDigits + 1 + layout.fracDigits;
+	}
+
+	// The character at span has to exist in the window: it is checked for being a separator.
+	return layout.span < 16 && layout.intDigits + layout.fracDigits > 0;
+}
+
+// Byte shuffle that drops the dot and right-aligns the digits, zeroing everything before them.
+CBVH_TARGET("sse4.1") inline __m128i DigitCompactionIndex(const DecimalLayout& layout)
+{
+	__m128i index = _mm_sub_epi8(
+		_mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15),
+		_mm_set1_epi8((char)(16 - layout.intDigits - layout.fracDigits)));
+
+	// Indices past the integer part skip over the dot. Negative ones have their top bit set and select zero.
+	return _mm_sub_epi8(index, _mm_cmpgt_epi8(index, _mm_set1_epi8((char)(layout.intDigits - 1))));
+}
+
+/*
+	Converts the scaled integer to the nearest float.
+	mantissa < 10^15 is exact as a double, and so are the powers of ten used: the division is correctly rounded.
+	Narrowing that double to float rounds a second time, which can only go wrong when the double lies exactly
+	halfway between two floats; that case (and anything outside the normal float range) is left to from_chars.
+*/
+inline bool ScaledIntegerToFloat(uint64_t mantissa, int fracDigits, bool negative, float* value)
+{
+	double result = (double)mantissa / s_powersOfTen[fracDigits];
+
+	uint64_t bits;
+	memcpy(&bits, &result, sizeof(bits));
+	if ((bits & 0x1FFFFFFF) == 0x10000000)
+		return false;
+	if (result != 0 && (result < FLT_MIN || result > FLT_MAX))
+		return false;
+
+	*value = negative ? -(float)result : (float)result;
+	return true;
+}
+
+CBVH_TARGET("sse4.1") inline void ClassifyDigits(__m128i characters, uint32_t& digitMask, uint32_t& dotMask)
+{
+	__m128i values = _mm_sub_epi8(characters, _mm_set1_epi8('0'));
+	__m128i isDigit = _mm_cmpeq_epi8(_mm_min_epu8(values, _mm_set1_epi8(9)), values);
+	digitMask = (uint32_t)_mm_movemask_epi8(isDigit);
+	dotMask = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(characters, _mm_set1_epi8('.')));
+}
+
+// Parses a single value, using the vector path when its layout allows it.
+CBVH_TARGET("sse4.1") static const char* ParseFloatSSE41(const char* cursor, const char* end, float* value)
+{
+	bool negative = *cursor == '-';
+	const char* digits = cursor + negative;
+	if (end - digits < 16)
+		return ParseFloatScalar(cursor, end, value);
+
+	__m128i characters = _mm_loadu_si128((const __m128i*)digits);
+
+	uint32_t digitMask, dotMask;
+	ClassifyDigits(characters, digitMask, dotMask);
+
+	DecimalLayout layout;
+	if (!ReadDecimalLayout(digitMask, dotMask, layout) || !IsTokenSeparator(digits[layout.span]))
+		return ParseFloatScalar(cursor, end, value);
+
+	__m128i packed = _mm_shuffle_epi8(_mm_sub_epi8(characters, _mm_set1_epi8('0')), DigitCompactionIndex(layout));
+
+	// 16 digits -> 8 pairs -> 4 groups of 4 -> 2 groups of 8
+	__m128i sums = _mm_maddubs_epi16(packed, _mm_setr_epi8(10, 1, 10, 1, 10, 1, 10, 1, 10, 1, 10, 1, 10, 1, 10, 1));
+	sums = _mm_madd_epi16(sums, _mm_setr_epi16(100, 1, 100, 1, 100, 1, 100, 1));
+	sums = _mm_packus_epi32(sums, sums);
+	sums = _mm_madd_epi16(sums, _mm_setr_epi16(10000, 1, 10000, 1, 10000, 1, 10000, 1));
+
+	uint64_t mantissa = (uint64_t)(uint32_t)_mm_cvtsi128_si32(sums) * 100000000 + (uint32_t)_mm_extract_epi32(sums, 1);
+
+	if (!ScaledIntegerToFloat(mantissa, layout.fracDigits, negative, value))
+		return ParseFloatScalar(cursor, end, value);
+
+	return digits + layout.span;
+}
+
+CBVH_TARGET("sse4.1") static const char* ParseFloatRowSSE41(const char* cursor, const char* end, float* values, int count)
+{
+	for (int i = 0; i < count; i++)
+	{
+		cursor = SkipTokenSeparators(cursor, end);
+		if (cursor == end)
+			return NULL;
+
+		cursor = ParseFloatSSE41(cursor, end, values + i);
+		if (!cursor)
+			return NULL;
+	}
+	return cursor;
+}
+
+#endif
+
+typedef const char* (*FloatRowKernel)(const char*, const char*, float*, int);
+
+// Indexed by SimdPath: the vector parser needs SSE4.1, wider registers have nothing to add to it
+static const FloatRowKernel s_floatRowKernels[SIMD_PATH_COUNT] =
+{
+	ParseFloatRowScalar,
+	ParseFloatRowScalar,
+#ifdef CBVH_X86
+	ParseFloatRowSSE41,
+	ParseFloatRowSSE41,
+	ParseFloatRowSSE41,
+#else
+	ParseFloatRowScalar,
+	ParseFloatRowScalar,
+	ParseFloatRowScalar,
+#endif
+};
+
+const char* ParseFloatRow(const char* cursor, const char* end, float* values, int count)
+{
+	return s_floatRowKernels[GetActiveSimdPath()](cursor, end, values, count);
+}
@@ -0,0 +1,55 @@
+/*
+	CBVH++: Loads a skeletal animation
+	Copyright(C) 2017 Vincent Petrella
+
+	This program is free software : you can redistribute it and / or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <cstddef>
+
+/*
+	Number parsing for the MOTION block of BVH files.
+
+	Values are read straight out of the file buffer: nothing has to be NUL terminated and nothing is allocated.
+	The decimal parser uses SSE4.1 when the CPU has it (see simd_Dispatch.h) and falls back to std::from_chars otherwise.
+	Either way, results are bit-identical to std::from_chars (round to nearest, locale independent).
+*/
+
+// Same separator set the tokenizer splits on.
+inline bool IsTokenSeparator(char c)
+{
+	return c == '\0' || c == '\n' || c == ' ' || c == '\r' || c == '\t' || c < 0;
+}
+
+inline const char* SkipTokenSeparators(const char* cursor, const char* end)
+{
+	while (cursor < end && IsTokenSeparator(*cursor))
+		cursor++;
+	return cursor;
+}
+
+/*
+	ParseFloatRow:
+	Parses count separator-delimited decimal values starting at cursor into values.
+	Returns the position right after the last value parsed, or NULL if a value is missing or malformed.
+*/
+const char* ParseFloatRow(const char* cursor, const char* end, float* values, int count);
+
+/*
+	Same as ParseFloatRow, but never uses SIMD. This is the reference the vectorized path has to match.
+*/
+const char* ParseFloatRowScalar(const char* cursor, const char* end, float* values, int count);
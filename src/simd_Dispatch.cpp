@@ -0,0 +1,112 @@
+/*
+	CBVH++: Loads a skeletal animation
+	Copyright(C) 2017 Vincent Petrella
+
+	This program is free software : you can redistribute it and / or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include "simd_Dispatch.h"
+#include <atomic>
+
+#if defined(CBVH_X86) && defined(_MSC_VER)
+#include <intrin.h>
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+static SimdPath DetectSimdPath()
+{
+#if defined(CBVH_X86) && defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 0);
+	int maxLeaf = info[0];
+
+	__cpuid(info, 1);
+	bool sse2 = (info[3] >> 26) & 1;
+	bool sse41 = (info[2] >> 19) & 1;
+	bool osxsave = (info[2] >> 27) & 1;
+
+	// The OS has to save the vector registers on context switches: YMM state for AVX2, ZMM and mask state for AVX-512
+	unsigned long long xcr0 = osxsave ? _xgetbv(0) : 0;
+	bool avx2 = false, avx512 = false;
+	if (maxLeaf >= 7)
+	{
+		__cpuidex(info, 7, 0);
+		avx2 = ((info[1] >> 5) & 1) && (xcr0 & 0x6) == 0x6;
+		avx512 = ((info[1] >> 16) & 1) && (xcr0 & 0xE6) == 0xE6;
+	}
+#elif defined(CBVH_X86) && defined(__GNUC__)
+	// These check the OS support too
+	__builtin_cpu_init();
+	bool sse2 = __builtin_cpu_supports("sse2");
+	bool sse41 = __builtin_cpu_supports("sse4.1");
+	bool avx2 = __builtin_cpu_supports("avx2");
+	bool avx512 = __builtin_cpu_supports("avx512f");
+#else
+	bool sse2 = false, sse41 = false, avx2 = false, avx512 = false;
+#endif
+
+	if (avx512 && avx2)
+		return SIMD_PATH_AVX512;
+	if (avx2 && sse41)
+		return SIMD_PATH_AVX2;
+	if (sse41 && sse2)
+		return SIMD_PATH_SSE41;
+	if (sse2)
+		return SIMD_PATH_SSE2;
+	return SIMD_PATH_SCALAR;
+}
+
+// -1 until the first kernel asks
+static atomic<int> s_activeSimdPath(-1);
+
+SimdPath GetSupportedSimdPath()
+{
+	static const SimdPath supportedPath = DetectSimdPath();
+	return supportedPath;
+}
+
+SimdPath GetActiveSimdPath()
+{
+	int path = s_activeSimdPath.load(memory_order_relaxed);
+	if (path < 0)
+	{
+		path = GetSupportedSimdPath();
+		s_activeSimdPath.store(path, memory_order_relaxed);
+	}
+	return (SimdPath)path;
+}
+
+void SetSimdPath(SimdPath path)
+{
+	if (path < SIMD_PATH_SCALAR || path > GetSupportedSimdPath())
+		path = GetSupportedSimdPath();
+
+	s_activeSimdPath.store(path, memory_order_relaxed);
+}
+
+const char* GetSimdPathName(SimdPath path)
+{
+	switch (path)
+	{
+	case SIMD_PATH_SCALAR:	return "scalar";
+	case SIMD_PATH_SSE2:	return "SSE2";
+	case SIMD_PATH_SSE41:	return "SSE4.1";
+	case SIMD_PATH_AVX2:	return "AVX2";
+	case SIMD_PATH_AVX512:	return "AVX-512";
+	default:				return "unknown";
+	}
+}
@@ -0,0 +1,63 @@
+/*
+	CBVH++: Loads a skeletal animation
+	Copyright(C) 2017 Vincent Petrella
+
+	This program is free software : you can redistribute it and / or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+/*
+	Runtime selection of the SIMD kernels (forward kinematics, number parsing).
+
+	Kernels are compiled for every instruction set below, whatever the compiler flags, and each call goes to the version
+	of the active path: one binary runs the best code each machine supports. glm itself still follows the compiler flags
+	(see GLM_ARCH in glm/simd/platform.h). All paths give bit-identical results.
+*/
+
+enum SimdPath
+{
+	SIMD_PATH_SCALAR,	// Plain C++
+	SIMD_PATH_SSE2,
+	SIMD_PATH_SSE41,
+	SIMD_PATH_AVX2,
+	SIMD_PATH_AVX512,	// AVX-512F
+	SIMD_PATH_COUNT
+};
+
+// Best path the CPU and the OS support, detected once
+SimdPath GetSupportedSimdPath();
+
+// Path kernels dispatch to: the supported one, unless SetSimdPath chose a lower one
+SimdPath GetActiveSimdPath();
+
+/*
+	Sends kernels to another path, to compare them or to reproduce what older machines do.
+	Paths the CPU does not support are lowered to the supported one. Do not call while other threads run kernels.
+*/
+void SetSimdPath(SimdPath path);
+
+const char* GetSimdPathName(SimdPath path);
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define CBVH_X86
+#endif
+
+// Compiles a function for an instruction set the compiler flags may not enable. MSVC takes any intrinsic anywhere.
+#if defined(__GNUC__)
+#define CBVH_TARGET(isa) __attribute__((target(isa)))
+#else
+#define CBVH_TARGET(isa)
+#endif
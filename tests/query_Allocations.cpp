@@ -0,0 +1,192 @@
+/*
+	CBVH++: Loads a skeletal animation
+	Copyright(C) 2017 Vincent Petrella
+
+	This program is free software : you can redistribute it and / or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <vector>
+#include <string>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include "animation.h"
+
+/*
+	Allocation test of the array query:
+
+	Counts every heap allocation with a global operator new, and checks that QuerySkeletalAnimation into caller arrays
+	allocates nothing once each skeleton has been queried once, for every motion storage.
+	Returns 0 if no query allocated.
+
+	Build from the src directory:
+		g++ -O2 -std=c++17 -pthread -I. *.cpp ../tests/query_Allocations.cpp -o ../query_Allocations
+*/
+
+static size_t s_allocationCount = 0;
+
+void* operator new(size_t size)
+{
+	s_allocationCount++;
+	if (void* memory = malloc(size ? size : 1))
+		return memory;
+	throw bad_alloc();
+}
+
+void* operator new[](size_t size)
+{
+	return operator new(size);
+}
+
+void* operator new(size_t size, align_val_t alignment)
+{
+	s_allocationCount++;
+	size_t alignedSize = (size + (size_t)alignment - 1) / (size_t)alignment * (size_t)alignment;
+	if (void* memory = aligned_alloc((size_t)alignment, alignedSize ? alignedSize : (size_t)alignment))
+		return memory;
+	throw bad_alloc();
+}
+
+void* operator new[](size_t size, align_val_t alignment)
+{
+	return operator new(size, alignment);
+}
+
+void operator delete(void* memory) noexcept { free(memory); }
+void operator delete[](void* memory) noexcept { free(memory); }
+void operator delete(void* memory, size_t) noexcept { free(memory); }
+void operator delete[](void* memory, size_t) noexcept { free(memory); }
+void operator delete(void* memory, align_val_t) noexcept { free(memory); }
+void operator delete[](void* memory, align_val_t) noexcept { free(memory); }
+void operator delete(void* memory, size_t, align_val_t) noexcept { free(memory); }
+void operator delete[](void* memory, size_t, align_val_t) noexcept { free(memory); }
+
+static const int FRAME_COUNT = 120;
+
+// Two skeletons: a short chain, and one that fans out (wider levels, more tracks)
+string MakeClip()
+{
+	string text = "HIERARCHY\n";
+	int channelCount = 0;
+
+	text += "ROOT Chain\n{\n\tOFFSET 0 0 0\n\tCHANNELS 6 Xposition Yposition Zposition Zrotation Xrotation Yrotation\n";
+	text += "\tJOINT Chain_0\n\t{\n\t\tOFFSET 0 2 0\n\t\tCHANNELS 3 Zrotation Xrotation Yrotation\n";
+	text += "\t\tEnd Site\n\t\t{\n\t\t\tOFFSET 0 1 0\n\t\t}\n\t}\n}\n";
+	channelCount += 9;
+
+	text += "ROOT Fan\n{\n\tOFFSET 1 0 0\n\tCHANNELS 6 Xposition Yposition Zposition Yrotation Xrotation Zrotation\n";
+	channelCount += 6;
+	for (int branch = 0; branch < 6; branch++)
+	{
+		string name = "Fan_" + to_string(branch);
+		text += "\tJOINT " + name + "\n\t{\n\t\tOFFSET 0.5 1 " + to_string(branch) + "\n\t\tCHANNELS 3 Xrotation Yrotation Zrotation\n";
+		text += "\t\tJOINT " + name + "_0\n\t\t{\n\t\t\tOFFSET 0 1 0\n\t\t\tCHANNELS 3 Xrotation Yrotation Zrotation\n";
+		text += "\t\t\tEnd Site\n\t\t\t{\n\t\t\t\tOFFSET 0 1 0\n\t\t\t}\n\t\t}\n\t}\n";
+		channelCount += 6;
+	}
+	text += "}\n";
+
+	text += "MOTION\nFrames: " + to_string(FRAME_COUNT) + "\nFrame Time: 0.008333\n";
+	for (int frame = 0; frame < FRAME_COUNT; frame++)
+	{
+		for (int channel = 0; channel < channelCount; channel++)
+		{
+			char value[32];
+			snprintf(value, sizeof(value), "%.4f ", 60.0f * sinf(0.05f * frame + 1.3f * channel));
+			text += value;
+		}
+		text += "\n";
+	}
+	return text;
+}
+
+// Queries every frame of every skeleton after a first query of each, returns the number of allocations made by the queries
+size_t CountQueryAllocations(SkeletalMotion* motion)
+{
+	int jointCount = motion->GetFlatSkeleton().GetJointCount();
+	int skeletonCount = (int)motion->GetFlatSkeleton().rootIndices.size();
+
+	vector<vec3> positions(jointCount);
+	vector<Transform> cumulativeTransforms(jointCount);
+	vector<pair<vec3, vec3>> segments(jointCount);
+
+	for (int skeleton = 0; skeleton < skeletonCount; skeleton++)
+		motion->QuerySkeletalAnimation(0, skeleton, true, positions.data(), cumulativeTransforms.data(), segments.data());
+
+	size_t allocationCount = s_allocationCount;
+	for (int frame = 0; frame < motion->GetFrameCount(); frame++)
+	{
+		for (int skeleton = 0; skeleton < skeletonCount; skeleton++)
+		{
+			motion->QuerySkeletalAnimation(frame, skeleton, true, positions.data(), cumulativeTransforms.data(), segments.data());
+			motion->QuerySkeletalAnimation(frame, skeleton, false, positions.data(), NULL, NULL);
+		}
+	}
+	return s_allocationCount - allocationCount;
+}
+
+int main()
+{
+	const char* clipPath = "query_Allocations.bvh";
+	FILE* clipFile = fopen(clipPath, "wb");
+	string clip = MakeClip();
+	if (!clipFile || fwrite(clip.data(), 1, clip.size(), clipFile) != clip.size() || fclose(clipFile))
+	{
+		printf("FAILED: could not write %s\n", clipPath);
+		return 1;
+	}
+
+	struct Configuration
+	{
+		const char*				name;
+		MotionStorage			storage;
+		bool					memoizeRotations;
+	};
+	const Configuration configurations[] =
+	{
+		{ "transforms", MOTION_STORAGE_TRANSFORMS, false },
+		{ "euler angles", MOTION_STORAGE_EULER_ANGLES, false },
+		{ "euler angles, memoized", MOTION_STORAGE_EULER_ANGLES, true },
+		{ "quaternions", MOTION_STORAGE_QUATERNIONS, false },
+	};
+
+	int failureCount = 0;
+	for (const Configuration& configuration : configurations)
+	{
+		BVHImportOptions options;
+		options.storage = configuration.storage;
+		options.memoizeRotations = configuration.memoizeRotations;
+
+		streambuf* output = cout.rdbuf(NULL);
+		SkeletalMotion* motion = SkeletalMotion::BVHImport(clipPath, options);
+		cout.rdbuf(output);
+		if (!motion)
+		{
+			printf("FAILED %s: the clip did not import\n", configuration.name);
+			failureCount++;
+			continue;
+		}
+
+		size_t allocationCount = CountQueryAllocations(motion);
+		printf("%s %s: %zu allocations\n", allocationCount ? "FAILED" : "passed", configuration.name, allocationCount);
+		if (allocationCount)
+			failureCount++;
+
+		delete motion;
+	}
+
+	remove(clipPath);
+	return failureCount ? 1 : 0;
+}